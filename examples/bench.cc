@@ -0,0 +1,760 @@
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/resource.h>
+
+#include "d3cpp.hh"
+#include "element.hh"
+
+/*! \brief join/traversal benchmarks
+ *
+ * Builds synthetic Element trees and times each phase of the d3 join
+ * (selectAll, index join, keyed join, nested mapping join, call,
+ * enter-append, exit-remove) for sizes min..max (x10 steps). Every
+ * measurement is printed as one JSON object per line:
+ *
+ *   {"phase":"index_join","n":1000,...,"ns_per_element":..,"allocs_per_element":..,"peak_rss_kb":..}
+ *
+ * Usage: bench [--min N] [--max N] [--width W] [--depth D] [--reps R] [--threads T] [--phase NAME]
+ *
+ * The tree has D levels of internal nodes with fan-out W between the
+ * root and the N "item" leaves. The last internal level is tagged
+ * "list" (the parents of the nested join), the others "g". Parallel
+ * phases use a pool of T threads (default: hardware concurrency).
+ */
+
+//------------------------------------------------------------------------------
+// allocation counting
+//------------------------------------------------------------------------------
+
+static std::atomic<std::size_t> g_allocations { 0 };
+static std::atomic<std::size_t> g_allocated_bytes { 0 };
+
+// every replaceable form (plain, array, nothrow, sized) goes through
+// these two, so that all allocations are counted and every delete
+// matches its new. not inlined: GCC would otherwise see free() on the
+// result of a new expression (-Wmismatched-new-delete)
+
+__attribute__((noinline)) static void* counted_allocate(std::size_t size) noexcept {
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    g_allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+    return std::malloc(size ? size : 1);
+}
+
+__attribute__((noinline)) static void counted_release(void *p) noexcept {
+    std::free(p);
+}
+
+void* operator new(std::size_t size) {
+    if (void *p = counted_allocate(size))
+        return p;
+    throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size) {
+    if (void *p = counted_allocate(size))
+        return p;
+    throw std::bad_alloc();
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+    return counted_allocate(size);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept {
+    return counted_allocate(size);
+}
+
+void operator delete(void* p) noexcept {
+    counted_release(p);
+}
+
+void operator delete[](void* p) noexcept {
+    counted_release(p);
+}
+
+void operator delete(void* p, const std::nothrow_t&) noexcept {
+    counted_release(p);
+}
+
+void operator delete[](void* p, const std::nothrow_t&) noexcept {
+    counted_release(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept {
+    counted_release(p);
+}
+
+void operator delete[](void* p, std::size_t) noexcept {
+    counted_release(p);
+}
+
+//------------------------------------------------------------------------------
+// Config
+//------------------------------------------------------------------------------
+
+struct Config {
+    std::size_t min_n { 1000 };
+    std::size_t max_n { 100000 };
+    int         width { 100 };
+    int         depth { 1 };
+    int         reps  { 3 };
+    int         threads { 0 }; // 0: hardware concurrency
+    std::string phase; // empty: all phases
+};
+
+//------------------------------------------------------------------------------
+// Fixture
+//------------------------------------------------------------------------------
+
+struct Point {
+    Point() = default;
+    Point(int id, int x, int y):
+        id(id), x(x), y(y)
+    {}
+    int id;
+    int x;
+    int y;
+};
+
+using document_type  = d3cpp::Document<Element>;
+using list_type      = std::vector<int>;
+
+struct Fixture {
+    std::unique_ptr<Element>       root; // unless pooled
+    std::unique_ptr<document_type> document;
+    bool                           pooled { false }; // elements from the document's ElementPool
+    std::vector<Element*>          lists; // last internal level
+    std::shared_ptr<d3cpp::ThreadPool> pool;
+};
+
+static volatile long g_sink;
+
+static const AttributeKey id_key("id"); // built once: no lookup per element
+
+static std::function<ElementIterator(Element*)> gen_iter = [](Element* e) { return ElementIterator(e); };
+
+// an unbounded ElementIterator walks the whole subtree: the parallel
+// selectAll may split it
+namespace d3cpp {
+    template <>
+    struct SplittableIterator<ElementIterator> {
+        static bool whole(const ElementIterator &it) { return it.max_depth == ElementIterator::UNBOUNDED; }
+    };
+}
+
+static std::function<bool(const Element*)> tag_predicate(const std::string &tag) {
+    return [tag](const Element* e) { return e->tag.compare(tag) == 0; };
+}
+
+// lists in document order; n items distributed round robin, ids in document order
+static void build_tree(Fixture &f, std::size_t n, int width, int depth, bool with_items=true) {
+    if (f.pooled && f.document && !f.root) {
+        // a long lived document: its pool is released and refilled
+        auto &pool = f.document->scratch<ElementPool>();
+        pool.release();
+        f.document->root = pool.create("root");
+    }
+    else if (f.pooled) {
+        f.document.reset();
+        f.root.reset();
+        f.document.reset(new document_type());
+        f.document->root = f.document->scratch<ElementPool>().create("root");
+    }
+    else {
+        f.document.reset();
+        f.root.reset(new Element("root"));
+        f.document.reset(new document_type(f.root.get()));
+    }
+    f.document->thread_pool(f.pool);
+    f.lists.clear();
+
+    std::vector<Element*> level { f.document->root };
+    for (int d=0;d<depth;++d) {
+        std::vector<Element*> next;
+        next.reserve(level.size() * width);
+        for (auto parent: level) {
+            for (int i=0;i<width;++i) {
+                next.push_back(&parent->append(d + 1 == depth ? "list" : "g"));
+            }
+        }
+        level.swap(next);
+    }
+    f.lists = level;
+
+    if (!with_items)
+        return;
+
+    auto num_parents = level.size();
+    auto per_parent  = n / num_parents;
+    auto extra       = n % num_parents;
+    int id = 0;
+    for (std::size_t p=0;p<num_parents;++p) {
+        auto count = per_parent + (p < extra ? 1 : 0);
+        for (std::size_t i=0;i<count;++i) {
+            level[p]->append("item").attr(id_key, std::to_string(id++));
+        }
+    }
+}
+
+static std::vector<Point> make_points(std::size_t n) {
+    std::vector<Point> points;
+    points.reserve(n);
+    for (std::size_t i=0;i<n;++i)
+        points.push_back({(int) i, (int) i, (int) (2*i)});
+    return points;
+}
+
+// heap allocated (longer than the small string buffer) string records
+static std::vector<std::string> make_records(std::size_t n) {
+    std::vector<std::string> records;
+    records.reserve(n);
+    for (std::size_t i=0;i<n;++i)
+        records.push_back("record-" + std::to_string(i) + "-0123456789abcdef");
+    return records;
+}
+
+// one list of item ids per "list" parent, matching build_tree
+static std::vector<list_type> make_lists(const Fixture &f) {
+    std::vector<list_type> result;
+    result.reserve(f.lists.size());
+    for (auto list: f.lists) {
+        list_type ids;
+        ids.reserve(list->children.size());
+        for (auto &c: list->children)
+            ids.push_back(std::stoi(c->attr(id_key)));
+        result.push_back(std::move(ids));
+    }
+    return result;
+}
+
+//------------------------------------------------------------------------------
+// Measurement
+//------------------------------------------------------------------------------
+
+struct Measurement {
+    double      ns { std::numeric_limits<double>::max() };
+    std::size_t allocations { 0 };
+    std::size_t bytes { 0 };
+};
+
+static long peak_rss_kb() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss; // kilobytes on linux
+}
+
+// setup is not timed; run is timed and its allocations counted; best of reps
+static void measure(const Config &config, const std::string &phase, std::size_t n,
+                    std::function<void()> setup, std::function<void()> run) {
+    if (!config.phase.empty() && config.phase != phase)
+        return;
+
+    Measurement best;
+    for (int r=0;r<config.reps;++r) {
+        setup();
+        auto allocations = g_allocations.load();
+        auto bytes       = g_allocated_bytes.load();
+        auto t0 = std::chrono::steady_clock::now();
+        run();
+        auto t1 = std::chrono::steady_clock::now();
+        double ns = (double) std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count();
+        if (ns < best.ns) {
+            best.ns          = ns;
+            best.allocations = g_allocations.load() - allocations;
+            best.bytes       = g_allocated_bytes.load() - bytes;
+        }
+    }
+
+    auto elements = (double) (n ? n : 1);
+    std::printf("{\"phase\":\"%s\",\"n\":%zu,\"width\":%d,\"depth\":%d,\"reps\":%d,"
+                "\"ns\":%.0f,\"ns_per_element\":%.3f,\"allocs_per_element\":%.3f,"
+                "\"bytes_per_element\":%.3f,\"peak_rss_kb\":%ld}\n",
+                phase.c_str(), n, config.width, config.depth, config.reps,
+                best.ns, best.ns / elements, best.allocations / elements,
+                best.bytes / elements, peak_rss_kb());
+    std::fflush(stdout);
+}
+
+//------------------------------------------------------------------------------
+// Phases
+//------------------------------------------------------------------------------
+
+static void run_phases(const Config &config, std::size_t n) {
+
+    using selection_type = document_type::selection_type;
+    using point_selection_type = d3cpp::Selection<Element, Point>;
+
+    Fixture f;
+    f.pool = std::make_shared<d3cpp::ThreadPool>(config.threads > 0 ? (std::size_t) config.threads : std::thread::hardware_concurrency());
+    std::unique_ptr<selection_type>       selection;
+    std::unique_ptr<point_selection_type> joined;
+    auto points = make_points(n);
+    auto records = make_records(n);
+
+    std::function<std::string(const Point&)>   point2key = [](const Point& p) { return std::to_string(p.id); };
+    std::function<std::string(const Element&)> elem2key  = [](const Element& e) { return e.attr(id_key); };
+    std::function<int(const Point&)>           point2id  = [](const Point& p) { return p.id; };
+    std::function<int(const Element&)>         elem2id   = [](const Element& e) { return std::stoi(e.attr(id_key)); };
+
+    auto select_items = [&]() {
+        build_tree(f, n, config.width, config.depth);
+        selection.reset(new selection_type(f.document->selectAll(tag_predicate("item"), gen_iter)));
+    };
+
+    measure(config, "select_all", n,
+            [&]() { build_tree(f, n, config.width, config.depth); },
+            [&]() { f.document->selectAll(tag_predicate("item"), gen_iter); });
+
+    measure(config, "select_all_parallel", n,
+            [&]() { build_tree(f, n, config.width, config.depth); },
+            [&]() { f.document->selectAll(d3cpp::execution::par, tag_predicate("item"), gen_iter); });
+
+    // the same elements from a live selection (seeded by the setup)
+    std::unique_ptr<d3cpp::LiveSelection<Element>> live;
+    measure(config, "live_select_all", n,
+            [&]() {
+                live.reset();
+                build_tree(f, n, config.width, config.depth);
+                live.reset(new d3cpp::LiveSelection<Element>(*f.document, tag_predicate("item")));
+            },
+            [&]() { live->selection(); });
+    live.reset();
+
+    // the same elements from the document's tag index (built by the setup)
+    measure(config, "select_tag", n,
+            [&]() {
+                build_tree(f, n, config.width, config.depth);
+                f.document->index_tags([](const Element* e) { return e->tag; });
+            },
+            [&]() { f.document->selectTag("item"); });
+
+    measure(config, "select_tag_attr", n,
+            [&]() {
+                build_tree(f, n, config.width, config.depth);
+                f.document->index_tags([](const Element* e) { return e->tag; });
+            },
+            [&]() {
+                f.document->selectTag("item", [](const Element* e) { return e->has_attr(id_key); });
+            });
+
+    measure(config, "index_join", n,
+            select_items,
+            [&]() { selection->data(points); });
+
+    measure(config, "index_join_strings", n,
+            select_items,
+            [&]() { selection->data(records); });
+
+    measure(config, "index_join_strings_ref", n,
+            select_items,
+            [&]() {
+                d3cpp::DataSpan<std::string> span(records);
+                selection->data(span);
+            });
+
+    measure(config, "keyed_join", n,
+            select_items,
+            [&]() { selection->data(points, point2key, elem2key); });
+
+    measure(config, "keyed_join_int", n,
+            select_items,
+            [&]() { selection->data(points, point2id, elem2id); });
+
+    measure(config, "sorted_join_int", n,
+            select_items,
+            [&]() { selection->data_sorted(points, point2id, elem2id); });
+
+    measure(config, "call", n,
+            [&]() {
+                select_items();
+                joined.reset(new point_selection_type(selection->data(points)));
+            },
+            [&]() {
+                joined->call([](Element *e, const Point& p) {
+                    e->attr("x", std::to_string(p.x));
+                });
+            });
+
+    // attribute setters: an interned key built once, then a number
+    // stored as such (formatted only when printed)
+    AttributeKey x_key("x");
+    AttributeKey y_key("y");
+
+    measure(config, "call_key", n,
+            [&]() {
+                select_items();
+                joined.reset(new point_selection_type(selection->data(points)));
+            },
+            [&]() {
+                joined->call([&x_key](Element *e, const Point& p) {
+                    e->attr(x_key, std::to_string(p.x));
+                });
+            });
+
+    measure(config, "call_typed", n,
+            [&]() {
+                select_items();
+                joined.reset(new point_selection_type(selection->data(points)));
+            },
+            [&]() {
+                joined->call([&x_key](Element *e, const Point& p) {
+                    e->attr(x_key, p.x);
+                });
+            });
+
+    // the same numbers through the column path, mapped by a scale
+    measure(config, "attr_scaled", n,
+            [&]() {
+                select_items();
+                joined.reset(new point_selection_type(selection->data(points)));
+            },
+            [&]() {
+                joined->attr(x_key, [](Element *e, const Point& p) { return p.x; },
+                             d3cpp::scale::Linear(0, (double) n, 0, 1000).clamp());
+            });
+
+    // a literal key would be interned (under a lock) by every call
+    measure(config, "call_parallel", n,
+            [&]() {
+                select_items();
+                joined.reset(new point_selection_type(selection->data(points)));
+            },
+            [&]() {
+                joined->call_parallel([&x_key](Element *e, const Point& p) {
+                    e->attr(x_key, std::to_string(p.x));
+                });
+            });
+
+    // per element callback overhead: std::function vs. a callable the
+    // join loop can inline
+    long sum = 0;
+    std::function<void(Element*, const Point&)> accumulate = [&sum](Element *e, const Point& p) { sum += p.x; };
+
+    measure(config, "call_std_function", n,
+            [&]() {
+                select_items();
+                joined.reset(new point_selection_type(selection->data(points)));
+            },
+            [&]() { joined->call(accumulate); });
+
+    measure(config, "call_inline", n,
+            [&]() {
+                select_items();
+                joined.reset(new point_selection_type(selection->data(points)));
+            },
+            [&]() { joined->call([&sum](Element *e, const Point& p) { sum += p.x; }); });
+
+    // items are leaves: nothing below a match is visited
+    measure(config, "select_all_visit", n,
+            [&]() { build_tree(f, n, config.width, config.depth); },
+            [&]() {
+                f.document->selectAll([](const Element* e) {
+                    return e->tag.compare("item") == 0 ? d3cpp::visit::match | d3cpp::visit::prune : d3cpp::visit::skip;
+                });
+            });
+
+    measure(config, "select_all_inline", n,
+            [&]() { build_tree(f, n, config.width, config.depth); },
+            [&]() {
+                f.document->selectAll([](const Element* e) { return e->tag.compare("item") == 0; },
+                                      [](Element* e) { return ElementIterator(e); });
+            });
+
+    measure(config, "keyed_join_int_inline", n,
+            select_items,
+            [&]() {
+                selection->data(points,
+                                [](const Point& p) { return p.id; },
+                                [](const Element& e) { return std::stoi(e.attr(id_key)); });
+            });
+
+    g_sink = sum;
+
+    measure(config, "enter_append", n,
+            [&]() {
+                build_tree(f, n, config.width, 0, false);
+                joined.reset(new point_selection_type(f.document->selectAll(tag_predicate("item"), gen_iter).data(points)));
+            },
+            [&]() {
+                joined->enter().append([](Element* parent, const Point& p) { return &parent->append("item"); });
+            });
+
+    measure(config, "enter_append_bulk", n,
+            [&]() {
+                build_tree(f, n, config.width, 0, false);
+                joined.reset(new point_selection_type(f.document->selectAll(tag_predicate("item"), gen_iter).data(points)));
+            },
+            [&]() {
+                joined->enter().append_bulk([](Element* parent, point_selection_type::enter_selection_type::data_range_type data,
+                                               std::vector<Element*> &appended) {
+                    appended.reserve(data.size());
+                    for (std::size_t i=0;i<data.size();++i)
+                        appended.push_back(&parent->append("item"));
+                });
+            });
+
+    // patch of 100 updated items: independent of n. the journal also
+    // costs the call that updates every item a notification each
+    std::unique_ptr<d3cpp::Journal<Element>> journal;
+    std::string patch;
+    ElementWriter tags;
+    auto write_tag = [&tags](const Element* e, std::string &out) { tags.write_start_tag(*e, out); };
+
+    measure(config, "journal_patch", n,
+            [&]() {
+                journal.reset();
+                select_items();
+                journal.reset(new d3cpp::Journal<Element>(*f.document));
+                std::vector<Point> few(points.begin(), points.begin() + std::min<std::size_t>(100, n));
+                selection->data(few).call([&x_key](Element *e, const Point& p) { e->attr(x_key, p.x); });
+                patch.clear();
+            },
+            [&]() { journal->patch(patch, write_tag); });
+
+    measure(config, "call_journaled", n,
+            [&]() {
+                journal.reset();
+                select_items();
+                journal.reset(new d3cpp::Journal<Element>(*f.document));
+                joined.reset(new point_selection_type(selection->data(points)));
+            },
+            [&]() {
+                joined->call([&x_key](Element *e, const Point& p) {
+                    e->attr(x_key, std::to_string(p.x));
+                });
+            });
+    journal.reset();
+
+    // one frame of a transition of every item's x and y: the buffers
+    // are interpolated in bulk and every value changed since the first
+    // frame is written back
+    measure(config, "transition_tick", n,
+            [&]() {
+                select_items();
+                joined.reset(new point_selection_type(selection->data(points)));
+                auto zero = [](Element *e, const Point& p) { return 0.0; };
+                joined->transition(1.0)
+                    .tween(zero, [](Element *e, const Point& p) { return (double) p.x; },
+                           [&x_key](Element *e, double v) { e->attr(x_key, v); })
+                    .tween(zero, [](Element *e, const Point& p) { return (double) p.y; },
+                           [&y_key](Element *e, double v) { e->attr(y_key, v); });
+                f.document->transitions().tick(0.0);
+            },
+            [&]() { f.document->transitions().tick(0.5); });
+
+    // serializing the tree: the writers keep their buffers across reps
+    ElementWriter indented;
+    ElementWriter compact(ElementWriter::COMPACT);
+    std::ostringstream sink;
+
+    measure(config, "serialize", n,
+            [&]() { build_tree(f, n, config.width, config.depth); },
+            [&]() { g_sink = (long) indented.write(*f.document->root).size(); });
+
+    measure(config, "serialize_compact", n,
+            [&]() { build_tree(f, n, config.width, config.depth); },
+            [&]() { g_sink = (long) compact.write(*f.document->root).size(); });
+
+    measure(config, "serialize_ostream", n,
+            [&]() {
+                build_tree(f, n, config.width, config.depth);
+                sink.str(std::string());
+            },
+            [&]() { sink << *f.document->root; });
+
+    // the same appends taking elements from the document's pool
+    f.pooled = true;
+    measure(config, "enter_append_pooled", n,
+            [&]() {
+                joined.reset();
+                build_tree(f, n, config.width, 0, false);
+                joined.reset(new point_selection_type(f.document->selectAll(tag_predicate("item"), gen_iter).data(points)));
+            },
+            [&]() {
+                joined->enter().append([](Element* parent, const Point& p) { return &parent->append("item"); });
+            });
+    joined.reset();
+    f.pooled = false;
+
+    // destroying the whole document: element by element, or pool slabs
+    for (auto pooled: { false, true }) {
+        measure(config, pooled ? "teardown_pooled" : "teardown", n,
+                [&]() {
+                    f.pooled = pooled;
+                    build_tree(f, n, config.width, config.depth);
+                },
+                [&]() {
+                    f.document.reset();
+                    f.root.reset();
+                });
+    }
+    f.pooled = false;
+
+    measure(config, "exit_remove", n,
+            [&]() {
+                select_items();
+                joined.reset(new point_selection_type(selection->data(std::vector<Point>())));
+            },
+            [&]() {
+                joined->exit().remove([](Element *e) { e->remove(); });
+            });
+
+    measure(config, "exit_remove_compact", n,
+            [&]() {
+                select_items();
+                joined.reset(new point_selection_type(selection->data(std::vector<Point>())));
+            },
+            [&]() { joined->exit().remove(); });
+
+    // half of the items leave and come back, ten times: the tree ends
+    // up with n items and, when removal tombstones, n/2 dead slots per
+    // round. the timed select_all shows the cost of those slots
+    for (auto compact: { false, true }) {
+        measure(config, compact ? "select_all_after_churn_compact" : "select_all_after_churn", n,
+                [&]() {
+                    build_tree(f, n, config.width, 0, false);
+                    for (int round=0;round<10;++round) {
+                        std::vector<Point> half(points.begin(), points.begin() + (round % 2 ? n : n / 2));
+                        auto s = f.document->selectAll(tag_predicate("item"), gen_iter).data(half);
+                        s.enter().append([](Element* parent, const Point& p) { return &parent->append("item"); });
+                        if (compact)
+                            s.exit().remove();
+                        else
+                            s.exit().remove([](Element *e) { e->remove(); });
+                    }
+                },
+                [&]() { f.document->selectAll(tag_predicate("item"), gen_iter); });
+    }
+
+    if (config.depth > 0) {
+        using list_selection_type = d3cpp::Selection<Element, list_type>;
+        using mapping_type        = std::function<list_type(const list_type&)>;
+
+        std::unique_ptr<list_selection_type> lists;
+        std::unique_ptr<list_selection_type> nested;
+        mapping_type mapping = [](const list_type& ids) { return ids; };
+
+        auto join_lists = [&]() {
+            build_tree(f, n, config.width, config.depth);
+            lists.reset(new list_selection_type(f.document->selectAll(tag_predicate("list"), gen_iter).data(make_lists(f))));
+        };
+
+        measure(config, "nested_select_all", n,
+                join_lists,
+                [&]() { lists->selectAll(tag_predicate("item"), gen_iter); });
+
+        measure(config, "nested_select_all_tree_iterator", n,
+                join_lists,
+                [&]() {
+                    lists->selectAll([](const Element* e) { return e->tag.compare("item") == 0; },
+                                     [](Element* e) { return d3cpp::TreeIterator<Element>(e); });
+                });
+
+        measure(config, "nested_select_all_visit", n,
+                join_lists,
+                [&]() { lists->selectAll([](const Element* e) { return e->tag.compare("item") == 0; }); });
+
+        measure(config, "nested_select_children", n,
+                join_lists,
+                [&]() { lists->selectChildren(tag_predicate("item")); });
+
+        measure(config, "nested_select_all_parallel", n,
+                join_lists,
+                [&]() { lists->selectAll(d3cpp::execution::par, tag_predicate("item"), gen_iter); });
+
+        measure(config, "nested_join", n,
+                [&]() {
+                    join_lists();
+                    nested.reset(new list_selection_type(lists->selectAll(tag_predicate("item"), gen_iter)));
+                },
+                [&]() { nested->data(mapping); });
+
+        measure(config, "nested_join_parallel", n,
+                [&]() {
+                    join_lists();
+                    nested.reset(new list_selection_type(lists->selectAll(tag_predicate("item"), gen_iter)));
+                },
+                [&]() { nested->data(d3cpp::execution::par, mapping); });
+
+        // the same joins matched by id (the ids of a list are its items)
+        auto data2id = [](int id) { return id; };
+        auto elem2id = [](const Element& e) { return std::stoi(e.attr(id_key)); };
+
+        measure(config, "nested_keyed_join", n,
+                [&]() {
+                    join_lists();
+                    nested.reset(new list_selection_type(lists->selectAll(tag_predicate("item"), gen_iter)));
+                },
+                [&]() { nested->data(mapping, data2id, elem2id); });
+
+        measure(config, "nested_keyed_join_parallel", n,
+                [&]() {
+                    join_lists();
+                    nested.reset(new list_selection_type(lists->selectAll(tag_predicate("item"), gen_iter)));
+                },
+                [&]() { nested->data(d3cpp::execution::par, mapping, data2id, elem2id); });
+
+        // select children, join by index, update: three selections, or
+        // one fused pass per list
+        auto ids_of   = [](const list_type& ids) -> const list_type& { return ids; };
+        auto update_x = [&x_key](Element *e, int id) { e->attr(x_key, id); };
+
+        measure(config, "nested_update", n,
+                join_lists,
+                [&]() { lists->selectChildren(tag_predicate("item")).data(ids_of).call(update_x); });
+
+        measure(config, "nested_update_fused", n,
+                join_lists,
+                [&]() { lists->joinChildren(tag_predicate("item"), ids_of).call(update_x); });
+    }
+
+    selection.reset();
+    joined.reset();
+}
+
+//------------------------------------------------------------------------------
+// main
+//------------------------------------------------------------------------------
+
+static bool parse_args(int argc, char** argv, Config &config) {
+    for (int i=1;i<argc;++i) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc)
+            return false;
+        std::string value = argv[++i];
+        if      (arg == "--min")   config.min_n = std::stoull(value);
+        else if (arg == "--max")   config.max_n = std::stoull(value);
+        else if (arg == "--width") config.width = std::stoi(value);
+        else if (arg == "--depth") config.depth = std::stoi(value);
+        else if (arg == "--reps")  config.reps  = std::stoi(value);
+        else if (arg == "--threads") config.threads = std::stoi(value);
+        else if (arg == "--phase") config.phase = value;
+        else return false;
+    }
+    return config.min_n > 0 && config.width > 0 && config.depth >= 0 && config.reps > 0;
+}
+
+int main(int argc, char** argv) {
+    Config config;
+    if (!parse_args(argc, argv, config)) {
+        std::cerr << "usage: bench [--min N] [--max N] [--width W] [--depth D] [--reps R] [--threads T] [--phase NAME]" << std::endl;
+        return 1;
+    }
+    for (auto n=config.min_n;n<=config.max_n;n*=10) {
+        run_phases(config, n);
+    }
+    return 0;
+}
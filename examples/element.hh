@@ -0,0 +1,875 @@
+#pragma once
+
+#include <iostream>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <string>
+#include <new>
+#include <type_traits>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_map>
+
+/*! \brief reference "tree" document used by the examples and benchmarks
+ *
+ * A minimal DOM-like element with a tag, attributes and owned
+ * children. d3cpp itself is agnostic to this type.
+ *
+ * Attribute names are interned (AttributeKey) and the attributes of
+ * an element kept in a small flat vector. Numeric values are stored
+ * as numbers and only formatted when read as text or printed.
+ *
+ * Elements are heap allocated one by one unless they come from an
+ * ElementPool: children are then taken from the pool of their parent.
+ */
+
+struct Element;
+struct ElementPool;
+
+//------------------------------------------------------------------------------
+// AttributeKey
+//------------------------------------------------------------------------------
+
+// interned attribute name. known names are looked up without locking,
+// new ones take a (global) lock. the lookup still hashes the name: hot
+// loops should build their keys once, e.g. static const AttributeKey x("x")
+
+struct AttributeKey {
+    AttributeKey() = default;
+    AttributeKey(const std::string &name);
+    AttributeKey(const char *name);
+
+    const std::string& name() const;
+
+    static std::uint32_t      intern(const std::string &name);
+    static const std::string& name_of(std::uint32_t id);
+
+    std::uint32_t id { 0 };
+};
+
+//------------------------------------------------------------------------------
+// Attribute
+//------------------------------------------------------------------------------
+
+struct Attribute {
+    enum Kind: unsigned char { TEXT, INTEGER, REAL };
+
+    void set(const std::string &value);
+    void set(std::int64_t value);
+    void set(double value);
+
+    // the value as text: numbers are formatted on every call, reads
+    // don't modify the attribute (safe from concurrent readers)
+    std::string text() const;
+
+    std::int64_t integer() const; // parses text values
+    double       real() const;
+
+    std::uint32_t  key { 0 };
+    Kind           kind { TEXT };
+    union {
+        std::int64_t i;
+        double       d;
+    } number { 0 };
+    std::string    text_value; // TEXT only
+};
+
+//------------------------------------------------------------------------------
+// Attributes
+//------------------------------------------------------------------------------
+
+// flat vector searched linearly: elements have a handful of attributes
+
+struct Attributes {
+    Attribute*       find(std::uint32_t key);
+    const Attribute* find(std::uint32_t key) const;
+    Attribute&       get_or_add(std::uint32_t key);
+
+    std::size_t count(const AttributeKey &key) const; // 0 or 1
+    std::size_t size() const;
+
+    std::vector<Attribute> items; // insertion order
+};
+
+//------------------------------------------------------------------------------
+// ElementDeleter
+//------------------------------------------------------------------------------
+
+// deletes pool-less elements, returns pooled ones to their pool
+
+struct ElementDeleter {
+    ElementDeleter() = default;
+    explicit ElementDeleter(ElementPool *pool);
+    void operator()(Element *e) const;
+    ElementPool *pool { nullptr };
+};
+
+using ElementPtr = std::unique_ptr<Element, ElementDeleter>;
+
+//------------------------------------------------------------------------------
+// Element
+//------------------------------------------------------------------------------
+
+struct Element {
+public:
+    using key_type = AttributeKey; // d3cpp::AttributeTraits::key
+
+    Element() = default;
+    Element(const std::string& tag, Element* parent=nullptr, int parent_index=0);
+    ~Element(); // iterative: deep trees don't overflow the stack
+    Element& append(const std::string &tag);
+    Element& attr(const AttributeKey &key, const std::string& value);
+    Element& attr(const AttributeKey &key, const char* value);
+    template <typename N, typename=typename std::enable_if<std::is_arithmetic<N>::value>::type>
+    Element& attr(const AttributeKey &key, N value); // stored as a number
+    std::string        attr(const AttributeKey &key) const; // throws std::out_of_range
+    const Attribute&   attribute(const AttributeKey &key) const; // same
+    std::int64_t attr_integer(const AttributeKey &key) const;
+    double       attr_real(const AttributeKey &key) const;
+    bool         has_attr(const AttributeKey &key) const;
+    void remove();
+public:
+    std::string tag;
+    Element*    parent {nullptr};
+    int         parent_index;
+    std::vector<ElementPtr> children; // might have nullptrs inside
+    Attributes  attributes;
+    ElementPool *pool {nullptr}; // where appended children come from (nullptr: new)
+};
+
+//------------------------------------------------------------------------------
+// ElementPool
+//------------------------------------------------------------------------------
+
+// slab allocator of elements: create() takes a freed slot or bumps a
+// pointer in the last slab, destroyed elements go to a free list.
+// release() destroys every element of the pool in slab order, without
+// walking the tree. keep one per document (e.g.
+// document.scratch<ElementPool>() with a root from create()) so
+// tearing down the document releases the pool
+
+struct ElementPool {
+public:
+    static const std::size_t SLAB_SIZE = 256; // elements per slab
+
+    ElementPool() = default;
+    ~ElementPool();
+
+    ElementPool(const ElementPool&) = delete;
+    ElementPool& operator=(const ElementPool&) = delete;
+
+    Element* create(const std::string& tag, Element* parent=nullptr, int parent_index=0);
+    void     destroy(Element *e); // no-op while releasing
+
+    // destroys all elements; pointers to them are invalid afterwards.
+    // the slabs are kept and filled again by the next elements
+    void     release();
+
+    bool        releasing() const;
+    std::size_t size() const; // live elements
+
+public:
+    struct Slot {
+        typename std::aligned_storage<sizeof(Element), alignof(Element)>::type storage;
+        bool live { false };
+    };
+
+    std::vector<std::unique_ptr<Slot[]>> slabs;
+    std::size_t        slab { 0 };  // slab being filled (slabs.size(): none)
+    std::size_t        used { 0 };  // slots handed out in that slab
+    std::vector<Slot*> free_slots;
+    std::size_t        live_count { 0 };
+    bool               in_release { false };
+};
+
+//------------------------------------------------------------------------------
+// ElementWriter
+//------------------------------------------------------------------------------
+
+// serializes element trees into a reusable buffer: iterative, no per
+// node allocation once the buffers are warm, no flushes. INDENTED is
+// the operator<< layout (four spaces per level, one tag per line);
+// COMPACT writes no indentation and no newlines
+
+struct ElementWriter {
+public:
+    enum Style { INDENTED, COMPACT };
+
+    static const std::size_t CHUNK_SIZE = 1 << 16; // bytes handed to the stream at once
+
+    explicit ElementWriter(Style style=INDENTED);
+
+    // buffer holds the serialized tree
+    const std::string& write(const Element &e);
+
+    // streamed through the buffer in CHUNK_SIZE pieces
+    void write(const Element &e, std::ostream &os);
+
+    // appends e's start tag with its attributes (no children) to out
+    void write_start_tag(const Element &e, std::string &out);
+
+public:
+    void _write(const Element &e, std::ostream *os);
+    void _open(const Element &e, std::size_t level);
+    void _close(const Element &e, std::size_t level);
+    void _indent(std::size_t level);
+    void _newline();
+    void _value(const Attribute &a);
+    const std::string& _name(std::uint32_t key);
+
+public:
+    struct Frame {
+        const Element *element;
+        std::size_t    next; // next child to visit
+    };
+
+    Style                           style;
+    std::string                     buffer;
+    std::vector<Frame>              stack;
+    std::vector<const Attribute*>   sorted;
+    std::vector<const std::string*> names; // by key id (nullptr: not looked up yet)
+};
+
+//------------------------------------------------------------------------------
+// ElementIterator
+//------------------------------------------------------------------------------
+
+struct ElementIterator {
+    struct Item {
+        Item() = default;
+        Item(Element *element, int depth);
+        Element* element { nullptr };
+        int depth;
+    };
+
+    static const int UNBOUNDED = -1;
+
+    ElementIterator(int max_depth=UNBOUNDED);
+    ElementIterator(Element *root, int max_depth=UNBOUNDED);
+    void push(Element *e); // level zero
+    void reset(Element *root); // restart at root keeping the stack capacity (and max_depth)
+
+    Element* next();
+
+    std::vector<Item> stack;
+    int max_depth { UNBOUNDED }; // indicates any level
+};
+
+//------------------------------------------------------------------------------
+// Element Impl.
+//------------------------------------------------------------------------------
+
+inline Element::Element(const std::string& tag, Element* parent, int parent_index):
+tag(tag),
+parent(parent),
+parent_index(parent_index)
+{}
+
+inline Element::~Element() {
+    // the pool destroys every element itself, children included
+    if (children.empty() || (pool && pool->releasing()))
+        return;
+
+    // detach the children of an element before it goes: every
+    // destructor below sees no children and returns right away
+    std::vector<ElementPtr> stack;
+    for (auto &c: children) {
+        if (c)
+            stack.push_back(std::move(c));
+    }
+    while (!stack.empty()) {
+        auto e = std::move(stack.back());
+        stack.pop_back();
+        for (auto &c: e->children) {
+            if (c)
+                stack.push_back(std::move(c));
+        }
+    }
+}
+
+inline void Element::remove() {
+    parent->children[parent_index].reset();
+}
+
+inline Element& Element::append(const std::string &tag) {
+    auto index = (int) children.size();
+    if (pool)
+        children.push_back(ElementPtr(pool->create(tag,this,index), ElementDeleter(pool)));
+    else
+        children.push_back(ElementPtr(new Element(tag,this,index)));
+    return *children.back().get();
+}
+
+inline Element& Element::attr(const AttributeKey &key, const std::string& value) {
+    attributes.get_or_add(key.id).set(value);
+    return *this;
+}
+
+inline Element& Element::attr(const AttributeKey &key, const char* value) {
+    attributes.get_or_add(key.id).set(std::string(value));
+    return *this;
+}
+
+template <typename N, typename>
+Element& Element::attr(const AttributeKey &key, N value) {
+    auto &a = attributes.get_or_add(key.id);
+    if (std::is_integral<N>::value)
+        a.set((std::int64_t) value);
+    else
+        a.set((double) value);
+    return *this;
+}
+
+inline const Attribute& Element::attribute(const AttributeKey &key) const {
+    auto a = attributes.find(key.id);
+    if (!a)
+        throw std::out_of_range("no attribute " + key.name());
+    return *a;
+}
+
+inline std::string Element::attr(const AttributeKey &key) const {
+    return attribute(key).text();
+}
+
+inline std::int64_t Element::attr_integer(const AttributeKey &key) const {
+    return attribute(key).integer();
+}
+
+inline double Element::attr_real(const AttributeKey &key) const {
+    return attribute(key).real();
+}
+
+inline bool Element::has_attr(const AttributeKey &key) const {
+    return attributes.find(key.id) != nullptr;
+}
+
+inline std::ostream& operator<<(std::ostream &os, const Element& e) {
+    ElementWriter writer;
+    writer.write(e, os);
+    return os;
+}
+
+//------------------------------------------------------------------------------
+// AttributeKey Impl.
+//------------------------------------------------------------------------------
+
+// names are looked up without locking: the hash table (open addressing,
+// slots set once) and the by-id chunks hold atomic pointers to entries
+// that never move. writers take the mutex; a table more than half full
+// is rebuilt at twice the capacity and published, readers still probing
+// the old one fall back to the locked path on a miss. superseded tables
+// are kept (a reader may hold one): their sizes halve, so all of them
+// take less than the current one. chunk k holds the ids 2^k-1..2^(k+1)-2
+
+struct AttributeNames {
+    struct Entry {
+        std::string   name;
+        std::size_t   hash;
+        std::uint32_t id;
+    };
+
+    struct Table {
+        explicit Table(std::size_t capacity);
+        const Entry* find(const std::string &name, std::size_t hash) const;
+        void         insert(const Entry *entry); // not full
+
+        std::size_t                                     mask;
+        std::unique_ptr<std::atomic<const Entry*>[]>    slots;
+    };
+
+    static const std::size_t CHUNKS = 32;
+
+    static AttributeNames& instance() {
+        static AttributeNames names;
+        return names;
+    }
+
+    const Table* table() const {
+        return published.load(std::memory_order_acquire);
+    }
+
+    // chunk of an id and its position in the chunk
+    static std::size_t chunk(std::uint32_t id, std::size_t &offset);
+
+    const Entry* entry(std::uint32_t id) const;
+
+    std::mutex                                  mutex;   // writers
+    std::deque<Entry>                           entries; // by id: stable references
+    std::vector<std::unique_ptr<Table>>         tables;  // current one last
+    std::atomic<const Table*>                   published { nullptr };
+    std::unique_ptr<std::atomic<const Entry*>[]> chunk_storage[CHUNKS];
+    std::atomic<std::atomic<const Entry*>*>      chunks[CHUNKS] {};
+};
+
+inline AttributeNames::Table::Table(std::size_t capacity):
+mask(capacity - 1),
+slots(new std::atomic<const Entry*>[capacity])
+{
+    for (std::size_t i=0;i<capacity;++i)
+        slots[i].store(nullptr, std::memory_order_relaxed);
+}
+
+inline auto AttributeNames::Table::find(const std::string &name, std::size_t hash) const -> const Entry* {
+    for (auto i = hash & mask;;i = (i + 1) & mask) {
+        auto entry = slots[i].load(std::memory_order_acquire);
+        if (!entry)
+            return nullptr;
+        if (entry->hash == hash && entry->name == name)
+            return entry;
+    }
+}
+
+inline void AttributeNames::Table::insert(const Entry *entry) {
+    auto i = entry->hash & mask;
+    while (slots[i].load(std::memory_order_relaxed))
+        i = (i + 1) & mask;
+    slots[i].store(entry, std::memory_order_release);
+}
+
+inline std::size_t AttributeNames::chunk(std::uint32_t id, std::size_t &offset) {
+    std::size_t k = 0;
+    for (auto v = (std::uint64_t) id + 1;v > 1;v >>= 1)
+        ++k;
+    offset = (std::size_t) ((std::uint64_t) id + 1 - ((std::uint64_t) 1 << k));
+    return k;
+}
+
+inline auto AttributeNames::entry(std::uint32_t id) const -> const Entry* {
+    std::size_t offset;
+    auto slots = chunks[chunk(id, offset)].load(std::memory_order_acquire);
+    return slots ? slots[offset].load(std::memory_order_acquire) : nullptr;
+}
+
+inline AttributeKey::AttributeKey(const std::string &name):
+id(intern(name))
+{}
+
+inline AttributeKey::AttributeKey(const char *name):
+id(intern(name))
+{}
+
+inline const std::string& AttributeKey::name() const {
+    return name_of(id);
+}
+
+inline std::uint32_t AttributeKey::intern(const std::string &name) {
+    auto &names = AttributeNames::instance();
+    auto hash = std::hash<std::string>()(name);
+    if (auto table = names.table()) {
+        if (auto entry = table->find(name, hash))
+            return entry->id;
+    }
+
+    std::lock_guard<std::mutex> lock(names.mutex);
+    auto table = names.table(); // another writer may have added it
+    if (table) {
+        if (auto entry = table->find(name, hash))
+            return entry->id;
+    }
+
+    auto id = (std::uint32_t) names.entries.size();
+    names.entries.push_back({name, hash, id});
+    auto entry = &names.entries.back();
+
+    std::size_t offset;
+    auto k = AttributeNames::chunk(id, offset);
+    auto &slots = names.chunk_storage[k];
+    if (!slots) {
+        auto size = (std::size_t) 1 << k;
+        slots.reset(new std::atomic<const AttributeNames::Entry*>[size]);
+        for (std::size_t i=0;i<size;++i)
+            slots[i].store(nullptr, std::memory_order_relaxed);
+        names.chunks[k].store(slots.get(), std::memory_order_release);
+    }
+    slots[offset].store(entry, std::memory_order_release);
+
+    if (!table || 2 * names.entries.size() > table->mask + 1) {
+        std::unique_ptr<AttributeNames::Table> grown(new AttributeNames::Table(table ? 2 * (table->mask + 1) : 16));
+        for (auto &e: names.entries)
+            grown->insert(&e);
+        names.tables.push_back(std::move(grown));
+        names.published.store(names.tables.back().get(), std::memory_order_release);
+    }
+    else {
+        names.tables.back()->insert(entry);
+    }
+    return id;
+}
+
+inline const std::string& AttributeKey::name_of(std::uint32_t id) {
+    auto entry = AttributeNames::instance().entry(id);
+    if (!entry)
+        throw std::out_of_range("no attribute name with id " + std::to_string(id));
+    return entry->name;
+}
+
+//------------------------------------------------------------------------------
+// Attribute Impl.
+//------------------------------------------------------------------------------
+
+inline void Attribute::set(const std::string &value) {
+    kind       = TEXT;
+    text_value = value;
+}
+
+inline void Attribute::set(std::int64_t value) {
+    kind     = INTEGER;
+    number.i = value;
+}
+
+inline void Attribute::set(double value) {
+    kind     = REAL;
+    number.d = value;
+}
+
+inline std::string Attribute::text() const {
+    switch (kind) {
+        case INTEGER:
+            return std::to_string(number.i);
+        case REAL: {
+            char buffer[32];
+            auto n = std::snprintf(buffer, sizeof(buffer), "%.15g", number.d);
+            return std::string(buffer, (std::size_t) n);
+        }
+        default:
+            return text_value;
+    }
+}
+
+inline std::int64_t Attribute::integer() const {
+    switch (kind) {
+        case INTEGER: return number.i;
+        case REAL:    return (std::int64_t) number.d;
+        default:      return std::stoll(text_value);
+    }
+}
+
+inline double Attribute::real() const {
+    switch (kind) {
+        case INTEGER: return (double) number.i;
+        case REAL:    return number.d;
+        default:      return std::stod(text_value);
+    }
+}
+
+//------------------------------------------------------------------------------
+// Attributes Impl.
+//------------------------------------------------------------------------------
+
+inline Attribute* Attributes::find(std::uint32_t key) {
+    for (auto &a: items) {
+        if (a.key == key)
+            return &a;
+    }
+    return nullptr;
+}
+
+inline const Attribute* Attributes::find(std::uint32_t key) const {
+    for (auto &a: items) {
+        if (a.key == key)
+            return &a;
+    }
+    return nullptr;
+}
+
+inline Attribute& Attributes::get_or_add(std::uint32_t key) {
+    if (auto a = find(key))
+        return *a;
+    if (items.empty())
+        items.reserve(4);
+    items.push_back(Attribute());
+    items.back().key = key;
+    return items.back();
+}
+
+inline std::size_t Attributes::count(const AttributeKey &key) const {
+    return find(key.id) ? 1 : 0;
+}
+
+inline std::size_t Attributes::size() const {
+    return items.size();
+}
+
+//------------------------------------------------------------------------------
+// ElementDeleter Impl.
+//------------------------------------------------------------------------------
+
+inline ElementDeleter::ElementDeleter(ElementPool *pool):
+pool(pool)
+{}
+
+inline void ElementDeleter::operator()(Element *e) const {
+    if (pool)
+        pool->destroy(e);
+    else
+        delete e;
+}
+
+//------------------------------------------------------------------------------
+// ElementPool Impl.
+//------------------------------------------------------------------------------
+
+inline ElementPool::~ElementPool() {
+    release();
+}
+
+inline Element* ElementPool::create(const std::string& tag, Element* parent, int parent_index) {
+    Slot *slot;
+    if (!free_slots.empty()) {
+        slot = free_slots.back();
+        free_slots.pop_back();
+    }
+    else {
+        if (slab == slabs.size() || used == SLAB_SIZE) {
+            if (slab < slabs.size())
+                ++slab;
+            if (slab == slabs.size())
+                slabs.push_back(std::unique_ptr<Slot[]>(new Slot[SLAB_SIZE]));
+            used = 0;
+        }
+        slot = &slabs[slab][used++];
+    }
+    auto e = new (&slot->storage) Element(tag, parent, parent_index);
+    e->pool    = this;
+    slot->live = true;
+    ++live_count;
+    return e;
+}
+
+inline void ElementPool::destroy(Element *e) {
+    if (in_release)
+        return;
+    // storage is the first member of Slot
+    auto slot = reinterpret_cast<Slot*>(e);
+    e->~Element();
+    slot->live = false;
+    --live_count;
+    free_slots.push_back(slot);
+}
+
+inline void ElementPool::release() {
+    in_release = true;
+    for (std::size_t s=0;s<slabs.size() && s<=slab;++s) {
+        std::size_t n = SLAB_SIZE;
+        if (s == slab)
+            n = used;
+        for (std::size_t i=0;i<n;++i) {
+            auto &slot = slabs[s][i];
+            if (slot.live) {
+                reinterpret_cast<Element*>(&slot.storage)->~Element();
+                slot.live = false;
+            }
+        }
+    }
+    in_release = false;
+
+    slab = 0;
+    used = 0;
+    free_slots.clear();
+    live_count = 0;
+}
+
+inline bool ElementPool::releasing() const {
+    return in_release;
+}
+
+inline std::size_t ElementPool::size() const {
+    return live_count;
+}
+
+//------------------------------------------------------------------------------
+// ElementWriter Impl.
+//------------------------------------------------------------------------------
+
+inline ElementWriter::ElementWriter(Style style):
+style(style)
+{}
+
+inline const std::string& ElementWriter::write(const Element &e) {
+    buffer.clear();
+    _write(e, nullptr);
+    return buffer;
+}
+
+inline void ElementWriter::write(const Element &e, std::ostream &os) {
+    buffer.clear();
+    _write(e, &os);
+    os.write(buffer.data(), buffer.size());
+    buffer.clear();
+}
+
+inline void ElementWriter::write_start_tag(const Element &e, std::string &out) {
+    // _open appends to buffer: lend it out
+    buffer.swap(out);
+    auto indented = style;
+    style = COMPACT;
+    _open(e, 0);
+    style = indented;
+    buffer.swap(out);
+}
+
+inline void ElementWriter::_write(const Element &e, std::ostream *os) {
+    stack.clear();
+    _open(e, 0);
+    if (!e.children.empty())
+        stack.push_back({&e, 0});
+
+    while (!stack.empty()) {
+        auto &frame    = stack.back();
+        auto &children = frame.element->children;
+        while (frame.next < children.size() && !children[frame.next])
+            ++frame.next;
+
+        if (frame.next == children.size()) {
+            _close(*frame.element, stack.size() - 1);
+            stack.pop_back();
+        }
+        else {
+            const Element *child = children[frame.next++].get();
+            _open(*child, stack.size());
+            if (!child->children.empty())
+                stack.push_back({child, 0}); // frame is invalid from here
+        }
+
+        if (os && buffer.size() >= CHUNK_SIZE) {
+            os->write(buffer.data(), buffer.size());
+            buffer.clear();
+        }
+    }
+}
+
+inline void ElementWriter::_open(const Element &e, std::size_t level) {
+    _indent(level);
+    buffer += '<';
+    buffer += e.tag;
+
+    // by name, like the std::map attributes always were
+    sorted.clear();
+    for (auto &a: e.attributes.items)
+        sorted.push_back(&a);
+    for (std::size_t i=1;i<sorted.size();++i) {
+        for (auto j=i;j>0 && _name(sorted[j]->key) < _name(sorted[j-1]->key);--j)
+            std::swap(sorted[j], sorted[j-1]);
+    }
+
+    for (auto a: sorted) {
+        buffer += ' ';
+        buffer += _name(a->key);
+        buffer += "=\"";
+        _value(*a);
+        buffer += '"';
+    }
+
+    if (e.children.empty())
+        buffer += "/>";
+    else
+        buffer += '>';
+    _newline();
+}
+
+inline void ElementWriter::_close(const Element &e, std::size_t level) {
+    _indent(level);
+    buffer += "</";
+    buffer += e.tag;
+    buffer += '>';
+    _newline();
+}
+
+inline void ElementWriter::_indent(std::size_t level) {
+    if (style == INDENTED)
+        buffer.append(level * 4, ' ');
+}
+
+inline void ElementWriter::_newline() {
+    if (style == INDENTED)
+        buffer += '\n';
+}
+
+inline void ElementWriter::_value(const Attribute &a) {
+    if (a.kind == Attribute::TEXT) {
+        buffer += a.text_value;
+    }
+    else if (a.kind == Attribute::INTEGER) {
+        // digits backwards into a local buffer
+        char digits[24];
+        auto end = digits + sizeof(digits);
+        auto p   = end;
+        auto negative = a.number.i < 0;
+        auto v = negative ? 0 - (std::uint64_t) a.number.i : (std::uint64_t) a.number.i;
+        do {
+            *--p = (char) ('0' + v % 10);
+            v /= 10;
+        } while (v);
+        if (negative)
+            *--p = '-';
+        buffer.append(p, end);
+    }
+    else {
+        char text[32];
+        auto n = std::snprintf(text, sizeof(text), "%.15g", a.number.d);
+        buffer.append(text, (std::size_t) n);
+    }
+}
+
+inline const std::string& ElementWriter::_name(std::uint32_t key) {
+    if (key >= names.size())
+        names.resize(key + 1, nullptr);
+    if (!names[key])
+        names[key] = &AttributeKey::name_of(key); // deque: stable reference
+    return *names[key];
+}
+
+//------------------------------------------------------------------------------
+// ElementIterator Impl.
+//------------------------------------------------------------------------------
+
+
+inline ElementIterator::Item::Item(Element *element, int depth):
+element(element),
+depth(depth)
+{}
+
+inline ElementIterator::ElementIterator(int max_depth):
+max_depth(max_depth)
+{}
+
+inline ElementIterator::ElementIterator(Element *root, int max_depth):
+    max_depth(max_depth)
+{
+    stack.push_back({root,0});
+}
+
+inline void ElementIterator::push(Element* e) {
+    stack.push_back({e,0});
+}
+
+inline void ElementIterator::reset(Element* root) {
+    stack.clear();
+    stack.push_back({root,0});
+}
+
+inline Element* ElementIterator::next() {
+
+    if (stack.empty())
+        return nullptr;
+
+    Item item = stack.back();
+    stack.pop_back();
+
+    // schedule processing of childrens
+    if (max_depth == UNBOUNDED || item.depth < max_depth) {
+        for (auto it=item.element->children.rbegin();it!=item.element->children.rend();++it) {
+            if (it->get())
+                stack.push_back( {it->get(), item.depth+1} );
+        }
+    }
+
+    return item.element;
+
+}
@@ -6,166 +6,7 @@
 #include <string>
 
 #include "d3cpp.hh"
-
-
-//------------------------------------------------------------------------------
-// Element
-//------------------------------------------------------------------------------
-
-struct Element {
-public:
-    Element() = default;
-    Element(const std::string& tag, Element* parent=nullptr, int parent_index=0);
-    Element& append(const std::string &tag);
-    Element& attr(const std::string& key, const std::string& value);
-    const std::string& attr(const std::string &key) const;
-    void remove();
-public:
-    std::string tag;
-    Element*    parent {nullptr};
-    int         parent_index;
-    std::vector<std::unique_ptr<Element>> children; // might have nullptrs inside
-    std::map<std::string, std::string> attributes;
-};
-
-//------------------------------------------------------------------------------
-// ElementIterator
-//------------------------------------------------------------------------------
-
-struct ElementIterator {
-    struct Item {
-        Item() = default;
-        Item(Element *element, int depth);
-        Element* element { nullptr };
-        int depth;
-    };
-    
-    static const int UNBOUNDED = -1;
-    
-    ElementIterator(int max_depth=UNBOUNDED);
-    ElementIterator(Element *root, int max_depth=UNBOUNDED);
-    void push(Element *e); // level zero
-    
-    Element* next();
-    
-    std::vector<Item> stack;
-    int max_depth { UNBOUNDED }; // indicates any level
-};
-
-
-
-
-//------------------------------------------------------------------------------
-// Element Impl.
-//------------------------------------------------------------------------------
-
-Element::Element(const std::string& tag, Element* parent, int parent_index):
-tag(tag),
-parent(parent),
-parent_index(parent_index)
-{}
-
-void Element::remove() {
-    parent->children[parent_index].reset();
-}
-
-Element& Element::append(const std::string &tag) {
-    children.push_back(std::unique_ptr<Element>(new Element(tag,this,(int) children.size())));
-    return *children.back().get();
-}
-
-Element& Element::attr(const std::string& key, const std::string& value) {
-    attributes[key] = value;
-    return *this;
-}
-
-const std::string& Element::attr(const std::string &key) const {
-    return attributes.at(key);
-}
-
-std::ostream& operator<<(std::ostream &os, const Element& e) {
-    
-    std::function<void(const Element& e, int level)> print =  [&os, &print](const Element& e, int level) {
-        
-        std::string prefix(level*4, ' ');
-        
-        os << prefix << "<" << e.tag;
-        for (auto it: e.attributes) {
-            os <<  " " << it.first << "=\"" << it.second << "\"";
-        }
-
-        if (!e.children.size()) {
-            os << "/>" << std::endl;
-        }
-        else {
-            os << ">" << std::endl;
-            for (auto &c: e.children) {
-                if (c)
-                    print(*c.get(), level + 1);
-            }
-            os << prefix << "</" << e.tag << ">" << std::endl;
-        }
-    };
-    
-    print(e, 0);
-    
-    return os;
-}
-
-//------------------------------------------------------------------------------
-// ElementIterator Impl.
-//------------------------------------------------------------------------------
-
-
-ElementIterator::Item::Item(Element *element, int depth):
-element(element),
-depth(depth)
-{}
-
-ElementIterator::ElementIterator(int max_depth):
-max_depth(max_depth)
-{}
-
-ElementIterator::ElementIterator(Element *root, int max_depth):
-    max_depth(max_depth)
-{
-    stack.push_back({root,0});
-}
-
-void ElementIterator::push(Element* e) {
-    stack.push_back({e,0});
-}
-
-Element* ElementIterator::next() {
-    
-    if (stack.empty())
-        return nullptr;
-    
-    Item item = stack.back();
-    stack.pop_back();
-    
-    // schedule processing of childrens
-    if (max_depth == UNBOUNDED || item.depth < max_depth) {
-        for (auto it=item.element->children.rbegin();it!=item.element->children.rend();++it) {
-            if (it->get())
-                stack.push_back( {it->get(), item.depth+1} );
-        }
-    }
-    
-    return item.element;
-    
-}
-
-
-
-
-
-
-
-
-
-
-
+#include "element.hh"
 
 //------------------------------------------------------------------------------
 // main
@@ -196,6 +37,14 @@ int main() {
     {
         Element root("root");
         document_type document(&root);
+        
+        // the "a" elements, kept up to date by the appends and removes below
+        d3cpp::LiveSelection<Element> a_elements(document, tag_predicate("a"));
+        
+        // what changed between the dumps below
+        d3cpp::Journal<Element> journal(document);
+        ElementWriter writer;
+        
         {
             std::vector<Point> points { {1,7}, {6,9}, {10,11} };
             
@@ -217,14 +66,17 @@ int main() {
             });
             
             std::cout << root;
+            journal.checkpoint(); // a remote copy got the full dump
         }
         
         
         {
             std::vector<Point> points { {29,30} };
             
-            auto join_selection = document
-            .selectAll(tag_predicate("a"), gen_iter)
+            // same as document.selectAll(tag_predicate("a"), gen_iter)
+            // without traversing the document
+            auto join_selection = a_elements
+            .selection()
             .data(points); // join data into current selection
             
             join_selection
@@ -241,6 +93,11 @@ int main() {
             });
             
             std::cout << root;
+            
+            // the same changes as a patch of the previous dump
+            std::string patch;
+            journal.patch(patch, [&writer](const Element* e, std::string &out) { writer.write_start_tag(*e, out); });
+            std::cout << patch;
         }
         
         
@@ -258,15 +115,10 @@ int main() {
             s1.enter()
             .append([](Element* parent, const list_type &list) { return &parent->append("list"); });
             
-            // couldn't use an inline version of this function... why?
-            // mapping
-            
-            using mapping_type = std::function<list_type(const list_type&)> ;
-            
-            //
+            // mapping: any callable (no std::function needed)
             auto s2 = s1
             .selectAll(tag_predicate("name"), gen_iter)
-            .data( (mapping_type) [](const list_type &s) { return s; });
+            .data( [](const list_type &s) { return s; });
             
             // .data(mapping);
             
@@ -366,26 +218,75 @@ int main() {
         
         
         
-        // how to join the current selection with the new
-        // data coming in:
-        
-        // to avoid a O(n^2) search if we give just a "match(Element, Data)"
-        // we can sort the elements "<"
-        
-        
-        // assume Data element is sortable: map Element -> Data
-        // match(Element,Data) lt(Element,Data) lt(Data,Data)
-        
-        // receive a vector of Data
-        
-        //
-        // sort the input Data
-        //
-        // for each element do a binary search to find Data entry that matches
-        //
-        // assign that element to that data
-        //
-    
+        // the same join by sorting data keys and element keys and merging
+        // them: deterministic, update and enter come out in data order
+        {
+            std::vector<std::string> update_texts { "poincare", "euler", "einstein" };
+            
+            using s2s_type = std::function<std::string(const std::string&)> ;
+            using e2s_type = std::function<std::string(const Element&)> ;
+            
+            s2s_type mapping_s = [](const std::string &s) -> std::string {
+                return s;
+            };
+            
+            e2s_type mapping_e = [](const Element &e) -> std::string {
+                return e.attr("name");
+            };
+            
+            auto selection = document
+            .selectAll(tag_predicate("person"), gen_iter)
+            .data_sorted(update_texts, mapping_s, mapping_e);
+            
+            selection
+            .exit()
+            .remove([](Element *e) { e->remove(); });
+            
+            selection
+            .enter()
+            .append([](Element* parent, const std::string& s) {
+                return &parent->append("person");
+            });
+            
+            selection
+            .call([](Element* e, const std::string& s) {
+                e->attr("name",s);
+            });
+        }
+
+        std::cout << root << std::endl;
+
+        // bind by reference: the selection points into update_texts
+        // instead of copying the strings (update_texts must outlive it)
+        {
+            std::vector<std::string> update_texts { "euler", "gauss", "einstein" };
+
+            d3cpp::DataSpan<std::string> span(update_texts);
+
+            auto selection = document
+            .selectAll(tag_predicate("person"), gen_iter)
+            .data(span,
+                  [](const std::string &s) { return s; },
+                  [](const Element &e) { return e.attr("name"); });
+
+            selection
+            .exit()
+            .remove([](Element *e) { e->remove(); });
+
+            selection
+            .enter()
+            .append([](Element* parent, const std::string& s) {
+                return &parent->append("person");
+            });
+
+            selection
+            .call([](Element* e, const std::string& s) {
+                e->attr("name",s);
+            });
+        }
+
+        std::cout << root << std::endl;
+
     }
     
     
@@ -411,18 +312,17 @@ int main() {
             s1.enter()
             .append([](Element* parent, const list_type &list) { return &parent->append("list"); });
             
-            // couldn't use an inline version of this function... why?
-            // mapping
-            
-            using mapping_type = std::function<list_type(const list_type&)> ;
-            
-            //
+            // mapping: any callable (no std::function needed)
             auto s2 = s1
             .selectAll(tag_predicate("name"), gen_iter)
-            .data( (mapping_type) [](const list_type &s) { return s; });
+            .data( [](const list_type &s) { return s; });
             
+            // all names of a list in one call
             s2.enter()
-            .append([](Element* parent, const std::string &st) { return &parent->append("name"); });
+            .append_bulk([](Element* parent, d3cpp::Range<list_type::const_iterator> names, std::vector<Element*> &appended) {
+                for (std::size_t i=0;i<names.size();++i)
+                    appended.push_back(&parent->append("name"));
+            });
             
             s2
             .call([](Element* e, std::string s) { e->attr("str", s); });
@@ -444,28 +344,25 @@ int main() {
                 return e.attr("str");
             };
 
-            // append lists
+            // append lists: lists never nest, so prune below a match
             auto s1 = document
-            .selectAll(tag_predicate("list"), gen_iter)
+            .selectAll([](const Element* e) { return e->tag == "list" ? d3cpp::visit::match | d3cpp::visit::prune : d3cpp::visit::skip; })
             .data(names);
             
             s1
             .enter()
             .append([](Element* parent, const list_type &list) { return &parent->append("list"); });
             
-            // couldn't use an inline version of this function... why?
-            // mapping
-            
-            using mapping_type = std::function<list_type(const list_type&)> ;
-            
-            //
+            // mapping: any callable (no std::function needed). names are
+            // direct children of their list: no subtree traversal needed
             auto s2 = s1
-            .selectAll(tag_predicate("name"), gen_iter)
-            .data( (mapping_type) [](const list_type &s) { return s; }, mapping_s, mapping_e);
+            .selectChildren(tag_predicate("name"))
+            .data( [](const list_type &s) { return s; }, mapping_s, mapping_e);
 
+            // compacts the children of each list (no null slots left)
             s2
             .exit()
-            .remove([](Element *e) { e->remove(); });
+            .remove();
             
             s2.enter()
             .append([](Element* parent, const std::string &st) { return &parent->append("name"); });
@@ -9,6 +9,20 @@
 #include <string>
 #include <deque>
 #include <unordered_map>
+#include <unordered_set>
+#include <typeindex>
+#include <type_traits>
+#include <utility>
+#include <cstdint>
+#include <limits>
+#include <chrono>
+#include <tuple>
+#include <atomic>
+#include <mutex>
+#include <cstdio>
+#include <cmath>
+
+#include "d3cpp_thread_pool.hh"
 
 /*! \brief d3 data driven documents selection mechanism for C++
  *
@@ -18,6 +32,62 @@
 
 namespace d3cpp {
     
+    //------------------------------------------------------------------------------
+    // detail: callable traits
+    //------------------------------------------------------------------------------
+    
+    // every callback can be given as any callable. the templated
+    // overloads are disabled when all callables are std::function so
+    // that those calls keep resolving to the std::function overloads
+    
+    namespace detail {
+        
+        template <typename F>
+        struct is_std_function: std::false_type {};
+        
+        template <typename R, typename... A>
+        struct is_std_function<std::function<R(A...)>>: std::true_type {};
+        
+        template <typename... F>
+        struct all_std_functions: std::true_type {};
+        
+        template <typename F, typename... Fs>
+        struct all_std_functions<F, Fs...>: std::integral_constant<bool,
+            is_std_function<typename std::decay<F>::type>::value && all_std_functions<Fs...>::value> {};
+        
+        template <typename... F>
+        using enable_if_callables = typename std::enable_if<!all_std_functions<F...>::value>::type;
+        
+        // U of a mapping callable T -> std::vector<U>
+        template <typename F, typename T>
+        using mapped_data_t = typename std::decay<decltype(std::declval<F&>()(std::declval<const T&>()))>::type::value_type;
+        
+        // an element of a container passed as V&&: moved out of rvalue
+        // containers, copied out of lvalue ones
+        template <typename V, typename X>
+        using forwarded_element_t = typename std::conditional<std::is_lvalue_reference<V>::value, const X&, X&&>::type;
+        
+        template <typename V, typename X>
+        forwarded_element_t<V,X> forward_element(X &x) {
+            return static_cast<forwarded_element_t<V,X>>(x);
+        }
+        
+        // iterators declared restartable (see RestartableIterator) are
+        // built once per traversal and restarted at every root with
+        // reset(E*), keeping their buffers; others are built again by
+        // gen_iterator for every root
+        template <typename I, typename G, typename E>
+        void restart_iterator(I &it, G&, E* root, std::true_type) {
+            it.reset(root);
+        }
+        
+        template <typename I, typename G, typename E>
+        void restart_iterator(I &it, G &gen_iterator, E* root, std::false_type) {
+            it = gen_iterator(root);
+        }
+        
+    } // detail
+    
     //------------------------------------------------------------------------------
     // ElementValue
     //------------------------------------------------------------------------------
@@ -33,732 +103,4959 @@ namespace d3cpp {
         T value;
     };
     
+    //------------------------------------------------------------------------------
+    // Range
+    //------------------------------------------------------------------------------
+    
+    // [first, last) view of a group's slice of a selection's element
+    // array (or of a group's entering data)
+    
+    template <typename It>
+    struct Range {
+        It          begin() const;
+        It          end() const;
+        std::size_t size() const;
+        bool        empty() const;
+        auto        operator[](std::size_t i) const -> decltype(*std::declval<It>());
+        
+        It first;
+        It last;
+    };
+    
     //------------------------------------------------------------------------------
     // Group
     //------------------------------------------------------------------------------
     
+    // groups don't own their elements: a group is its parent and the
+    // [offset, offset + count) slice of its selection's element array
+    
     template <typename E, typename T>
     struct Group {
         
         using element_value_type = ElementValue<E, T>;
         
         Group() = default;
-        Group(element_value_type parent);
-        // Group(E* parent_node, E* single);
-        
-        Group& add(E* e, T value);
-        Group& add(E* e);
+        Group(element_value_type parent, std::size_t offset);
         
         element_value_type parent;
-        std::vector<element_value_type> elements;
+        std::size_t        offset { 0 };
+        std::size_t        count  { 0 };
     };
     
+    //------------------------------------------------------------------------------
+    // ExitGroup
+    //------------------------------------------------------------------------------
     
-    template <typename E, typename T>
-    struct EnterSelection;
+    template <typename E>
+    struct ExitGroup {
+        ExitGroup() = default;
+        ExitGroup(E* parent, std::size_t offset);
+        
+        E           *parent { nullptr };
+        std::size_t offset  { 0 };
+        std::size_t count   { 0 };
+    };
     
-    template <typename E, typename T>
-    struct ExitSelection;
     
     //------------------------------------------------------------------------------
-    // Selection
+    // TreeTraits
     //------------------------------------------------------------------------------
     
-    // two types are associated with a selection: the enter/update type
-    // and the exit type
+    // customization point describing how to walk the user's tree. the
+    // default expects e->children to be a sequence of (possibly null)
+    // raw or smart pointers in document order; specialize for other
+    // layouts.
     
-    template <typename E, typename T>
-    struct Selection {
-    public:
+    template <typename E>
+    struct TreeTraits {
         
-        using element_type         = E;
-        using data_type            = T;
-        using selection_type       = Selection;
-        using enter_selection_type = EnterSelection<E, T>;
-        using group_type           = Group<E, T>;
-        using element_value_type   = ElementValue<E,T>;
+        // calls f(E*) for every non null child of e in document order
+        template <typename F>
+        static void for_each_child(E* e, F&& f);
         
-        using predicate_type       = std::function<bool(const E*)>;
-        using append_function_type = std::function<E*(E*)>;
-        using call_type            = std::function<void(E*, const T&)>;
-
-
+        static bool has_children(E* e);
         
-        using remove_from_document_function_type = std::function<void(E*)>;
-        using remove_from_group_function_type = std::function<void(remove_from_document_function_type)>;
+        // e->parent (nullptr at the root) and e's position among its
+        // parent's children. only needed to order elements in document
+        // order (LiveSelection)
+        static E*          parent(E* e);
+        static std::size_t index(E* e);
         
-    public:
+        // calls f(E*) for e and every element below it in pre-order
+        template <typename F>
+        static void for_each_in_subtree(E* e, F&& f);
         
-        Selection() = default;
+        // true iff a comes before b in document order (pre-order)
+        static bool document_order(E* a, E* b);
         
-        Selection(E *element);
-
-        Selection(const selection_type& other);
-        Selection(selection_type&& other);
-        Selection& operator=(const selection_type& other);
-        Selection& operator=(selection_type&& other);
+        // removes the children of e for which is_removed(E*) is true, in
+        // one pass: the others are compacted (order kept) and their
+        // index() renumbered. is_removed is called once per non null
+        // child in document order; null slots are dropped. the default
+        // erases from e->children (smart pointers destroy the element)
+        // and sets child->parent_index
+        template <typename F>
+        static void erase_children(E* e, F&& is_removed);
         
-        // group_type& _group_add(E *parent_node, E* new_child);
-        group_type& _group_add(element_value_type parent);
-        group_type& _group_add(element_type *parent_node);
+        // hint: about count children are going to be appended to e. the
+        // default grows e->children geometrically when E has a children
+        // member with reserve() and capacity() (appends repeated frame
+        // after frame stay amortized O(1)), and does nothing otherwise
+        static void reserve_children(E* e, std::size_t count);
         
-        template <typename U>
-        Selection<E,U> data(const std::vector<U>& data);
-
-        template <typename U, typename K>
-        Selection<E,U> data(const std::vector<U>& data,
-                            std::function<K(const U&)> data2key,
-                            std::function<K(const E&)> elem2key);
+        static E*   pointer(E* child);
+        template <typename P>
+        static E*   pointer(const P& child);
+    };
+    
+    //------------------------------------------------------------------------------
+    // TreeIterator
+    //------------------------------------------------------------------------------
+    
+    // pre-order iterator over a subtree (root included) through
+    // TreeTraits, for the gen_iterator overloads of selectAll:
+    //
+    //     s.selectAll(p, [](E* e) { return TreeIterator<E>(e); })
+    //
+    // reset() restarts it at another root keeping the stack capacity,
+    // so selectAll reuses one iterator for all its groups.
+    
+    // opt-in of an iterator type I to that reuse: selectAll then calls
+    // gen_iterator for the first root only and it.reset(root) for the
+    // others. declare it only when gen_iterator(root) is equivalent to
+    // resetting to root, i.e. it configures nothing else per root (no
+    // depth limit or filter taken from the root)
+    
+    template <typename I>
+    struct RestartableIterator: std::false_type {};
+    
+    template <typename E>
+    struct TreeIterator;
+    
+    template <typename E>
+    struct RestartableIterator<TreeIterator<E>>: std::true_type {};
+    
+    // opt-in of an iterator type I to the splitting of the parallel
+    // selectAll: whole(it) is true when it yields its root and then the
+    // whole subtree in TreeTraits pre-order (no depth limit, no filter).
+    // only those subtrees are split; their pieces are walked by
+    // TreeIterators. by default nothing is split: each root is walked by
+    // its own gen_iterator(root), concurrently with the other roots
+    
+    template <typename I>
+    struct SplittableIterator {
+        static bool whole(const I&) { return false; }
+    };
+    
+    template <typename E>
+    struct SplittableIterator<TreeIterator<E>> {
+        static bool whole(const TreeIterator<E>&) { return true; }
+    };
+    
+    template <typename E>
+    struct TreeIterator {
         
-        template <typename U>
-        Selection<E,U> data(std::function<std::vector<U>(const T&)>); // forwarding data based on original data
+        TreeIterator() = default;
+        TreeIterator(E* root);
         
-
-        template <typename U, typename K>
-        Selection<E,U> data(std::function<std::vector<U>(const T&)> mapping,
-                            std::function<K(const U&)> data2key,
-                            std::function<K(const E&)> elem2key);
-
-        // attr and append should be abstracted to applying a function...
-        // Selection<E,T>& attr(const std::string &key,  std::function<std::string(T,int)> f);
-        selection_type        append(append_function_type a);
+        void reset(E* root);
         
-        template <typename I> // can add additional constraint of how to search for children
-        selection_type        selectAll(predicate_type p, std::function<I(E*)> gen_iterator);
+        E*   next(); // nullptr once the subtree is exhausted
         
-        enter_selection_type& enter();
-        selection_type&       exit();
+        std::vector<E*> stack;
+    };
+    
+    //------------------------------------------------------------------------------
+    // TraversalScratch
+    //------------------------------------------------------------------------------
+    
+    // reusable stack of the visitor driven selectAll
+    
+    template <typename E>
+    struct TraversalScratch {
+        std::vector<E*> stack;
+    };
+    
+    //------------------------------------------------------------------------------
+    // AttributeTraits
+    //------------------------------------------------------------------------------
+    
+    // customization point of Selection::attr: how the key given by the
+    // caller is converted (once per call, not per element) and how a
+    // number is written to an element's attribute. key() builds an
+    // E::key_type when E declares one and copies the key otherwise;
+    // set_number calls e->attr(key, value)
+    
+    namespace detail {
         
-        selection_type&       call(call_type f);
+        template <typename E, typename K, typename=void>
+        struct attribute_key {
+            using type = typename std::decay<const K>::type;
+        };
         
-        selection_type&       remove(remove_from_document_function_type remove_from_document_function);
+        template <typename E, typename K>
+        struct attribute_key<E, K, typename std::conditional<true, void, typename E::key_type>::type> {
+            using type = typename E::key_type;
+        };
         
-    public:
+        template <typename E, typename K>
+        using attribute_key_t = typename attribute_key<E,K>::type;
         
-        enter_selection_type& _enterSelection_init(); // data per group mode
-        void                  _enterSelection_add(group_type* main_selection_group, int index, const std::vector<T>& group_data);  // data per group mode
-
-        enter_selection_type& _enterSelection_init(const std::vector<T>& shared_data); // shared data mode
-        void                  _enterSelection_add(group_type* main_selection_group, int index); // shared data mode
-
-    public:
-        selection_type& _exitSelection_init();
+    }
+    
+    template <typename E>
+    struct AttributeTraits {
+        template <typename K>
+        static detail::attribute_key_t<E,K> key(const K& key);
         
-    public:
-        std::vector<std::unique_ptr<group_type>> groups;
-        std::unique_ptr<enter_selection_type> enter_selection;
-        std::unique_ptr<selection_type>       exit_selection;
+        template <typename K>
+        static void set_number(E* e, const K& key, double value);
     };
     
+    //------------------------------------------------------------------------------
+    // scale: numeric kernels of Selection::attr
+    //------------------------------------------------------------------------------
+    
+    // a scale maps one value (operator()) or a whole column in place
+    // (apply). apply is a plain loop over contiguous doubles that the
+    // compiler can vectorize (Log calls std::log per value)
+    
+    namespace scale {
+        
+        struct Identity {
+            double operator()(double v) const { return v; }
+            void   apply(double*, std::size_t) const {}
+        };
+        
+        // values outside [lo,hi] are moved to the nearest bound
+        struct Clamp {
+            Clamp(double lo, double hi);
+            double operator()(double v) const;
+            void   apply(double *values, std::size_t n) const;
+            double lo, hi;
+        };
+        
+        // domain [d0,d1] to range [r0,r1]; clamp() limits the results
+        // to the range
+        struct Linear {
+            Linear(double d0, double d1, double r0, double r1);
+            Linear& clamp(bool clamp=true);
+            double  operator()(double v) const;
+            void    apply(double *values, std::size_t n) const;
+            double  d0, r0, k, lo, hi;
+            bool    clamped { false };
+        };
+        
+        // linear in log(v); the domain must not contain 0
+        struct Log {
+            Log(double d0, double d1, double r0, double r1);
+            Log&   clamp(bool clamp=true);
+            double operator()(double v) const;
+            void   apply(double *values, std::size_t n) const;
+            Linear linear; // of the logs
+        };
+        
+    } // scale
+    
+    //------------------------------------------------------------------------------
+    // AttributeScratch
+    //------------------------------------------------------------------------------
+    
+    // reusable column of Selection::attr
+    
+    struct AttributeScratch {
+        std::vector<double> column;
+    };
     
     //------------------------------------------------------------------------------
-    // Document
+    // Stats
     //------------------------------------------------------------------------------
     
-    template <typename E>
-    struct Document {
-        using predicate_type       = std::function<bool(const E*)>;
-        using selection_type       = Selection<E,int>;
+    // counters and phase timings of the operations on a document's
+    // selections (Document::stats()). only collected when compiled with
+    // D3CPP_STATS defined: otherwise every update is behind a constant
+    // false test and compiles away, and the counters stay 0
+    
+    struct Stats {
         
-    public:
-        Document() = default;
-        Document(E* root);
+#ifdef D3CPP_STATS
+        static constexpr bool enabled = true;
+#else
+        static constexpr bool enabled = false;
+#endif
         
-        template <typename I> // can add additional constraint of how to search for children
-        selection_type selectAll(predicate_type p, std::function<I(E*)> gen_iterator);
+        enum Phase { SELECT, DATA, APPEND, REMOVE, CALL, NUM_PHASES };
         
-        E *root { nullptr };
+        static const char* phase_name(Phase phase);
+        
+        std::uint64_t visited          { 0 }; // elements reached by select* traversals
+        std::uint64_t predicate_calls  { 0 }; // predicates and visitors of select*
+        std::uint64_t hash_lookups     { 0 }; // key index inserts and finds of keyed joins
+        std::uint64_t hash_collisions  { 0 }; // slots probed past the first by those
+        std::uint64_t groups           { 0 }; // groups joined by data()
+        std::uint64_t update           { 0 }; // update, enter and exit elements of the joins
+        std::uint64_t enter            { 0 };
+        std::uint64_t exit             { 0 };
+        std::uint64_t max_group_update { 0 }; // largest of one group
+        std::uint64_t max_group_enter  { 0 };
+        std::uint64_t max_group_exit   { 0 };
+        std::uint64_t bytes            { 0 }; // element (capacity) and group buffers of the selections built
+        
+        std::uint64_t calls[NUM_PHASES] {};
+        std::uint64_t ns[NUM_PHASES]    {}; // steady clock
     };
     
     //------------------------------------------------------------------------------
-    // EnterSelection
+    // Tracer
     //------------------------------------------------------------------------------
     
-    template <typename E, typename T>
-    struct EnterSelection {
+    // timeline of the selection operations (selectAll, data, append,
+    // remove, call, the groups of nested joins and the chunks of the
+    // parallel ones) in Chrome's trace event format, for chrome://tracing
+    // or Perfetto. compiled in with D3CPP_TRACE defined, recorded between
+    // start() and stop() of the process wide Tracer::global():
+    //
+    //     d3cpp::Tracer::global().start();
+    //     ... one frame ...
+    //     d3cpp::Tracer::global().stop();
+    //     d3cpp::Tracer::global().write_json(file);
+    //
+    // every thread records into its own ring (the oldest events are
+    // overwritten) without locking; start() and write_json() read the
+    // rings and must not run while operations are traced
+    
+    struct Tracer {
+    public:
         
-        enum Mode { SINGLE_SHARED_LIST, ONE_LIST_PER_GROUP };
+#ifdef D3CPP_TRACE
+        static constexpr bool enabled = true;
+#else
+        static constexpr bool enabled = false;
+#endif
         
-        using group_type           = Group<E, T>;
-        using selection_type       = Selection<E, T>;
-        using enter_selection_type = EnterSelection<E, T>;
-        using append_function_type = std::function<E*(E*, const T&)>;
+        struct Event {
+            const char    *name;     // a literal
+            std::uint64_t begin;     // ns since start()
+            std::uint64_t duration;  // ns
+            std::int64_t  arg;       // elements, group or chunk index; -1: none
+        };
         
-        struct Entry {
-            Entry() = default;
-            Entry(group_type* group, int index);
-            group_type*  group;
-            int          index;
+        // single producer: only its thread pushes
+        struct Ring {
+            static const std::size_t CAPACITY = 1 << 15;
+            
+            Ring(std::uint32_t tid);
+            void push(const Event &event);
+            
+            std::vector<Event>         events;
+            std::atomic<std::uint64_t> head { 0 }; // events pushed
+            std::uint32_t              tid;
         };
         
-        EnterSelection(selection_type *update_selection); // shared list mode
-        EnterSelection(selection_type *update_selection, const std::vector<T> &enter_data); // shared list mode
+    private:
         
-        enter_selection_type& _add(group_type* update_selection_group, int index);
-        enter_selection_type& _add(group_type* update_selection_group, int index, const std::vector<T> &enter_data);
+        // only global(): ring() caches the calling thread's ring in a
+        // thread_local shared by every instance
+        Tracer() = default;
         
-        selection_type        append(append_function_type a);
+    public:
+        
+        Tracer(const Tracer&) = delete;
+        Tracer& operator=(const Tracer&) = delete;
+        
+        static Tracer& global();
+        
+        void start(); // drops the recorded events
+        void stop();
+        bool active() const;
+        
+        std::uint64_t now() const; // ns since start()
+        Ring&         ring();      // of the calling thread
+        
+        void write_json(std::ostream &os) const;
         
     public:
-        // there are two modes
-        Mode mode;
-        selection_type *update_selection;
-        std::vector<Entry>          entries;
-        std::vector<std::vector<T>> enter_data;
+        std::atomic<bool>                     recording { false };
+        std::chrono::steady_clock::time_point epoch;
+        mutable std::mutex                    mutex; // rings
+        std::vector<std::unique_ptr<Ring>>    rings; // kept after their threads end
     };
     
+    namespace detail {
+        
+        // one Tracer event from construction to destruction (when
+        // Tracer::enabled and recording)
+        struct TraceScope {
+            TraceScope(const char *name, std::int64_t arg=-1);
+            ~TraceScope();
+            
+            TraceScope(const TraceScope&) = delete;
+            TraceScope& operator=(const TraceScope&) = delete;
+            
+            const char    *name { nullptr };
+            std::int64_t  arg   { -1 };
+            std::uint64_t begin { 0 };
+        };
+        
+    } // detail
+    
     //------------------------------------------------------------------------------
-    // ElementValue Impl.
+    // KeyIndex
     //------------------------------------------------------------------------------
     
-    template <typename E, typename T>
-    ElementValue<E,T>::ElementValue(E* element):
-    element(element)
-    {}
+    // flat open-addressing (linear probing) map from join keys to data
+    // indices. clear() is O(1) and keeps the capacity, so one index can
+    // be reused across groups and frames without touching the heap.
+    // Every operation takes the key hash so callers hash a key once.
     
-    template <typename E, typename T>
-    ElementValue<E,T>::ElementValue(E* element, T value):
-    element(element),
-    value(value)
-    {}
+    template <typename K, typename Hash=std::hash<K>>
+    struct KeyIndex {
+        
+        static const std::size_t npos = ~std::size_t(0);
+        
+        struct Slot {
+            std::size_t   hash  { 0 };
+            std::size_t   value { npos };
+            std::uint32_t epoch { 0 }; // slot is live iff epoch == index epoch
+            K             key;
+        };
+        
+        KeyIndex() = default;
+        
+        std::size_t  hash(const K& key) const;
+        
+        void         clear();
+        void         reserve(std::size_t n);
+        
+        // returns the value previously associated with key or npos
+        std::size_t  insert(K key, std::size_t hash, std::size_t value);
+        std::size_t* find(const K& key, std::size_t hash);
+        
+        std::size_t  size() const;
+        std::size_t  capacity() const;
+        
+    private:
+        void         _rehash(std::size_t capacity);
+        
+    public:
+        Hash              hasher;
+        std::vector<Slot> slots;
+        std::size_t       mask  { 0 };
+        std::size_t       count { 0 };
+        std::uint32_t     epoch { 1 };
+        
+        // inserts and finds, and the extra slots they probed (only
+        // counted with Stats::enabled); never reset by clear()
+        std::size_t       lookups    { 0 };
+        std::size_t       collisions { 0 };
+    };
     
     //------------------------------------------------------------------------------
-    // Group Impl.
+    // KeyedJoinScratch
     //------------------------------------------------------------------------------
     
-    template <typename E, typename T>
-    Group<E,T>::Group(element_value_type parent):
-    parent(parent)
-    {}
+    // reusable buffers of the keyed data() joins
     
-//    template <typename E, typename T>
-//    Group<E,T>::Group(E* parent_node, E* single):
-//    parent(parent_node)
-//    {
-//        elements.push_back({single});
-//    }
+    template <typename K>
+    struct KeyedJoinScratch {
+        enum State : unsigned char { SHADOWED=0, AVAILABLE=1, CONSUMED=2 };
+        
+        void reset(std::size_t n);
+        
+        KeyIndex<K>                index;
+        std::vector<unsigned char> state; // per datum
+        std::size_t                available { 0 };
+    };
     
-    template<typename E, typename T>
-    auto Group<E,T>::add(E* e, T value) -> Group& {
-        elements.push_back({e,value});
-        return *this;
-    }
+    //------------------------------------------------------------------------------
+    // JoinChunk
+    //------------------------------------------------------------------------------
     
-    template<typename E, typename T>
-    auto Group<E,T>::add(E* e) -> Group& {
-        elements.push_back({e});
-        return *this;
-    }
+    // output of one task of a parallel nested data() join: the groups
+    // it joined, in order, and their update and exit elements. merged
+    // into the result selection in group order. S is the task's scratch
+    
+    template <typename E, typename U, typename S>
+    struct JoinChunk {
+        struct GroupJoin {
+            std::size_t    group;
+            std::size_t    update_end;          // in update
+            std::size_t    exit_end;            // in exit
+            int            enter_index { -1 };  // -1: no enter entry
+            std::vector<U> enter;
+        };
+        
+        std::vector<ElementValue<E,U>> update;
+        std::vector<E*>                exit;
+        std::vector<GroupJoin>         groups;
+        S                              scratch;
+    };
     
     //------------------------------------------------------------------------------
-    // Selection Impl.
+    // SortedJoinScratch
     //------------------------------------------------------------------------------
     
-    template <typename E, typename T>
-    Selection<E,T>::Selection(E* element)
-    {
-        groups.push_back(std::unique_ptr<group_type>(new group_type(element)));
-    }
+    // reusable buffers of the sort-merge data_sorted() joins. keys are
+    // sorted together with their original position; integral keys use
+    // an LSD radix sort, other keys std::sort on (key, position).
     
-    template <typename E, typename T>
-    Selection<E,T>::Selection(const selection_type& other) {
-        if (other.exit_selection || other.enter_selection)
+    template <typename K>
+    struct SortedJoinScratch {
+        static const std::uint32_t none = ~std::uint32_t(0);
+        
+        using entry_type = std::pair<K, std::uint32_t>;
+        
+        void sort(std::vector<entry_type> &keys);
+        
+    private:
+        void _sort(std::vector<entry_type> &keys, std::true_type  integral_key);
+        void _sort(std::vector<entry_type> &keys, std::false_type integral_key);
+        
+    public:
+        std::vector<entry_type>    data_keys;
+        std::vector<entry_type>    element_keys;
+        std::vector<entry_type>    radix_buffer;
+        std::vector<std::uint32_t> match;     // per datum: matched element position or none
+        std::vector<unsigned char> matched;   // per element
+    };
+    
+    //------------------------------------------------------------------------------
+    // DataGuard
+    //------------------------------------------------------------------------------
+    
+    // tells whether data bound by reference can still be read
+    
+    struct DataGuard {
+        virtual ~DataGuard() = default;
+        virtual bool valid() const = 0;
+    };
+    
+    //------------------------------------------------------------------------------
+    // DataRef
+    //------------------------------------------------------------------------------
+    
+    // datum bound by reference: converts to const U& so that callbacks
+    // taking const U& read the caller's datum without a copy
+    
+    template <typename U>
+    struct DataRef {
+        DataRef() = default;
+        DataRef(const U* datum);
+        
+        const U& get() const;
+        operator const U&() const;
+        
+        const U *datum { nullptr };
+    };
+    
+    //------------------------------------------------------------------------------
+    // DataSpan
+    //------------------------------------------------------------------------------
+    
+    // caller owned data joined by reference: data(span) produces a
+    // Selection<E,DataRef<U>> whose values point into source. The
+    // selections check, once per call/append, that the span is still
+    // alive and that source was not resized or reallocated since.
+    
+    template <typename U>
+    struct DataSpan {
+        
+        struct Guard: DataGuard {
+            bool valid() const override;
+            
+            const std::vector<U> *source;
+            const U              *first;
+            std::size_t          size;
+            bool                 alive { true };
+        };
+        
+        DataSpan(const std::vector<U> &source);
+        ~DataSpan();
+        
+        DataSpan(const DataSpan&) = delete;
+        DataSpan& operator=(const DataSpan&) = delete;
+        
+        std::size_t size() const;
+        
+        const std::vector<U>        &source;
+        std::vector<DataRef<U>>     refs;  // one per datum, built once
+        std::shared_ptr<Guard>      guard;
+    };
+    
+    //------------------------------------------------------------------------------
+    // execution policies
+    //------------------------------------------------------------------------------
+    
+    namespace execution {
+        
+        struct Sequential {};
+        
+        struct Parallel {
+            Parallel() = default;
+            explicit Parallel(ThreadPool *pool, std::size_t grain=1024);
+            
+            ThreadPool  *pool  { nullptr }; // nullptr: the document's pool
+            std::size_t  grain { 1024 };    // elements per task
+        };
+        
+        static const Sequential seq {};
+        static const Parallel   par {};
+        
+    } // execution
+    
+    // pool used by parallel operations on selections without a document
+    ThreadPool& default_thread_pool();
+    
+    //------------------------------------------------------------------------------
+    // visit: traversal protocol
+    //------------------------------------------------------------------------------
+    
+    // a visitor given to selectAll(visitor) is called once per element
+    // reached and returns a combination of these flags
+    
+    namespace visit {
+        
+        using flags = unsigned;
+        
+        static const flags skip  = 0; // not selected, descend into its children
+        static const flags match = 1; // selected
+        static const flags prune = 2; // do not descend into its children
+        static const flags stop  = 4; // end the traversal (of this group)
+        
+    } // visit
+    
+    //------------------------------------------------------------------------------
+    // ease: easing functions of transitions
+    //------------------------------------------------------------------------------
+    
+    // map the normalized time t in [0,1] to the interpolation factor
+    
+    namespace ease {
+        
+        using function_type = double (*)(double);
+        
+        inline double linear(double t) {
+            return t;
+        }
+        
+        inline double quad_in_out(double t) {
+            t *= 2;
+            if (t <= 1)
+                return t * t / 2;
+            t -= 1;
+            return (t * (2 - t) + 1) / 2;
+        }
+        
+        inline double cubic_in_out(double t) { // d3's default
+            t *= 2;
+            if (t <= 1)
+                return t * t * t / 2;
+            t -= 2;
+            return (t * t * t + 2) / 2;
+        }
+        
+    } // ease
+    
+    template <typename E>
+    struct Document;
+    
+    template <typename E>
+    struct TagIndex;
+    
+    template <typename E>
+    struct Transitions;
+    
+    template <typename E, typename T>
+    struct SelectionTransition;
+    
+    namespace detail {
+        
+        struct NoEnter;
+        struct NoExit;
+        
+        template <typename U>
+        struct SharedData;
+        
+        template <typename F>
+        struct MappedData;
+        
+    } // detail
+    
+    template <typename E, typename T, typename P, typename D, typename A=detail::NoEnter, typename X=detail::NoExit>
+    struct ChildrenJoin;
+    
+    template <typename E, typename T>
+    struct Selection;
+    
+    namespace detail {
+        
+        // accounts one operation of phase on document (if any) in its
+        // Stats: times it and takes its counts. it is also the Tracer
+        // event name. a no-op unless Stats::enabled or Tracer::enabled
+        template <typename E>
+        struct PhaseScope {
+            
+            PhaseScope(Document<E> *document, Stats::Phase phase, const char *name);
+            ~PhaseScope();
+            
+            PhaseScope(const PhaseScope&) = delete;
+            PhaseScope& operator=(const PhaseScope&) = delete;
+            
+            void visited(std::size_t n, std::size_t predicate_calls);
+            
+            // takes (and zeroes) the counters of a key index
+            template <typename I>
+            void hashed(I &index);
+            
+            // sizes of a built selection, and of its enter and exit parts
+            template <typename U>
+            void built(const Selection<E,U> &selection);
+            
+            template <typename U>
+            void joined(const Selection<E,U> &selection);
+            
+            Stats                                 *target { nullptr };
+            Stats::Phase                          phase;
+            std::chrono::steady_clock::time_point start;
+            TraceScope                            trace; // arg: elements built
+        };
+        
+        // takes the key index counters of a keyed join's scratch; other
+        // scratches have none
+        template <typename E, typename K>
+        void take_hashed(PhaseScope<E> &scope, KeyedJoinScratch<K> &scratch) {
+            scope.hashed(scratch.index);
+        }
+        
+        template <typename E, typename S>
+        void take_hashed(PhaseScope<E>&, S&) {}
+        
+    } // detail
+    
+    //------------------------------------------------------------------------------
+    // DocumentObserver
+    //------------------------------------------------------------------------------
+    
+    // on_append is called once the element (and whatever the append
+    // callback built below it) is in the tree, on_remove right before the
+    // element is removed, while its subtree can still be walked, and
+    // on_update after a call() callback ran on the element
+    
+    template <typename E>
+    struct DocumentObserver {
+        virtual ~DocumentObserver() = default;
+        virtual void on_append(E* parent, E* element) = 0;
+        virtual void on_remove(E* element) = 0;
+        virtual void on_update(E*) {}
+    };
+    
+    template <typename E, typename T>
+    struct EnterSelection;
+    
+    template <typename E>
+    struct ExitSelection;
+    
+    //------------------------------------------------------------------------------
+    // Selection
+    //------------------------------------------------------------------------------
+    
+    // two types are associated with a selection: the enter/update type
+    // and the exit type
+    
+    template <typename E, typename T>
+    struct Selection {
+    public:
+        
+        using element_type         = E;
+        using data_type            = T;
+        using selection_type       = Selection;
+        using enter_selection_type = EnterSelection<E, T>;
+        using exit_selection_type  = ExitSelection<E>;
+        using group_type           = Group<E, T>;
+        using element_value_type   = ElementValue<E,T>;
+        using range_type           = Range<element_value_type*>;
+        using const_range_type     = Range<const element_value_type*>;
+        
+        using document_type        = Document<E>;
+        using predicate_type       = std::function<bool(const E*)>;
+        using append_function_type = std::function<E*(E*)>;
+        using call_type            = std::function<void(E*, const T&)>;
+
+
+        
+        using remove_from_document_function_type = std::function<void(E*)>;
+        using remove_from_group_function_type = std::function<void(remove_from_document_function_type)>;
+        
+    public:
+        
+        Selection() = default;
+        
+        Selection(E *element);
+
+        Selection(const selection_type& other);
+        Selection(selection_type&& other);
+        Selection& operator=(const selection_type& other);
+        Selection& operator=(selection_type&& other);
+        
+        // groups are built one after the other: elements are always
+        // added to the last group
+        group_type& _group_add(element_value_type parent);
+        group_type& _group_add(element_type *parent_node);
+        void        _element_add(E* e, T value);
+        void        _element_add(E* e);
+        
+        range_type       elements_of(const group_type &g);
+        const_range_type elements_of(const group_type &g) const;
+        
+        std::size_t size() const; // number of elements in all groups
+        bool        empty() const;
+        
+        template <typename U>
+        Selection<E,U> data(const std::vector<U>& data);
+        
+        // rvalue data are moved into the update and enter selections
+        template <typename U>
+        Selection<E,U> data(std::vector<U>&& data);
+
+        template <typename U, typename K>
+        Selection<E,U> data(const std::vector<U>& data,
+                            std::function<K(const U&)> data2key,
+                            std::function<K(const E&)> elem2key);
+        
+        template <typename U>
+        Selection<E,U> data(std::function<std::vector<U>(const T&)>); // forwarding data based on original data
+        
+
+        template <typename U, typename K>
+        Selection<E,U> data(std::function<std::vector<U>(const T&)> mapping,
+                            std::function<K(const U&)> data2key,
+                            std::function<K(const E&)> elem2key);
+        
+        // same joins with arbitrary callables: calls are bound at compile
+        // time and can be inlined into the join loops
+        template <typename U, typename D2K, typename E2K, typename=detail::enable_if_callables<D2K,E2K>>
+        Selection<E,U> data(const std::vector<U>& data, D2K&& data2key, E2K&& elem2key);
+        
+        template <typename U, typename D2K, typename E2K>
+        Selection<E,U> data(std::vector<U>&& data, D2K&& data2key, E2K&& elem2key);
+        
+        template <typename F, typename U=detail::mapped_data_t<F,T>, typename=detail::enable_if_callables<F>>
+        Selection<E,U> data(F&& mapping);
+        
+        template <typename F, typename D2K, typename E2K, typename U=detail::mapped_data_t<F,T>, typename=detail::enable_if_callables<F,D2K,E2K>>
+        Selection<E,U> data(F&& mapping, D2K&& data2key, E2K&& elem2key);
+        
+        // same nested joins with the groups joined concurrently on the
+        // policy's pool (about policy.grain elements per task): mapping,
+        // data2key and elem2key are called from several threads. the
+        // result is the serial join's
+        template <typename F, typename U=detail::mapped_data_t<F,T>>
+        Selection<E,U> data(const execution::Parallel &policy, F&& mapping);
+        
+        template <typename F, typename D2K, typename E2K, typename U=detail::mapped_data_t<F,T>>
+        Selection<E,U> data(const execution::Parallel &policy, F&& mapping, D2K&& data2key, E2K&& elem2key);
+        
+        // same joins binding data by reference (see DataSpan): no datum
+        // is copied. data2key still receives const U&
+        template <typename U>
+        Selection<E,DataRef<U>> data(const DataSpan<U>& span);
+        
+        template <typename U, typename D2K, typename E2K>
+        Selection<E,DataRef<U>> data(const DataSpan<U>& span, D2K&& data2key, E2K&& elem2key);
+
+        // sort-merge keyed join for keys with operator<. each group is
+        // joined against the whole data independently. update and enter
+        // come out in data order, exit in element order; equal keys are
+        // paired in order and the extra data/elements enter/exit
+        template <typename U, typename K>
+        Selection<E,U> data_sorted(const std::vector<U>& data,
+                                   std::function<K(const U&)> data2key,
+                                   std::function<K(const E&)> elem2key);
+        
+        template <typename U, typename K>
+        Selection<E,U> data_sorted(std::function<std::vector<U>(const T&)> mapping,
+                                   std::function<K(const U&)> data2key,
+                                   std::function<K(const E&)> elem2key);
+        
+        template <typename U, typename D2K, typename E2K, typename=detail::enable_if_callables<D2K,E2K>>
+        Selection<E,U> data_sorted(const std::vector<U>& data, D2K&& data2key, E2K&& elem2key);
+        
+        template <typename U, typename D2K, typename E2K>
+        Selection<E,U> data_sorted(std::vector<U>&& data, D2K&& data2key, E2K&& elem2key);
+        
+        template <typename F, typename D2K, typename E2K, typename U=detail::mapped_data_t<F,T>, typename=detail::enable_if_callables<F,D2K,E2K>>
+        Selection<E,U> data_sorted(F&& mapping, D2K&& data2key, E2K&& elem2key);
+        
+        template <typename U, typename D2K, typename E2K>
+        Selection<E,DataRef<U>> data_sorted(const DataSpan<U>& span, D2K&& data2key, E2K&& elem2key);
+        
+        // numeric attribute from the bound data: projection(e, d) of every
+        // element is gathered into one column, mapped by the scale in
+        // bulk, then written back (AttributeTraits::key, set_number)
+        template <typename K, typename P>
+        selection_type&       attr(const K& key, P&& projection);
+        
+        template <typename K, typename P, typename S>
+        selection_type&       attr(const K& key, P&& projection, const S& scale);
+        
+        // appends a(e) to every element e; same groups and data as this
+        selection_type        append(append_function_type a);
+        
+        template <typename I> // can add additional constraint of how to search for children
+        selection_type        selectAll(predicate_type p, std::function<I(E*)> gen_iterator);
+        
+        template <typename P, typename G, typename=detail::enable_if_callables<P,G>>
+        selection_type        selectAll(P&& p, G&& gen_iterator);
+        
+        // same groups and element order as the serial selectAll. parents
+        // are traversed concurrently and, when there are few of them and
+        // their iterators walk whole subtrees (SplittableIterator), their
+        // subtrees are split (TreeTraits) into independent pieces.
+        // p and gen_iterator are called concurrently.
+        template <typename P, typename G>
+        selection_type        selectAll(const execution::Parallel &policy, P&& p, G&& gen_iterator);
+        
+        // one group per element holding the descendants (the element
+        // itself excluded) for which visitor(E*) returns visit::match,
+        // in pre-order. visit::prune skips the children of an element
+        // and visit::stop ends the group early. a bool predicate is a
+        // visitor too (true is visit::match): children come from
+        // TreeTraits, no iterator factory is needed. the stack is the
+        // document's scratch, reused across groups and calls
+        template <typename V>
+        selection_type        selectAll(V&& visitor);
+        
+        // one group per element holding its children accepted by
+        // predicate: reads TreeTraits::for_each_child, no traversal
+        selection_type        selectChildren();
+        
+        template <typename P>
+        selection_type        selectChildren(P&& predicate);
+        
+        // lazy "selectChildren(predicate).data(...)" followed by call():
+        // the children are joined by index and updated in one pass per
+        // element, without intermediate selections (see ChildrenJoin).
+        // data are shared by every element or mapping(d) of its datum.
+        // the join refers to this selection and to shared data: both
+        // must outlive it (temporary data vectors don't compile)
+        template <typename P, typename U>
+        ChildrenJoin<E,T,P,detail::SharedData<U>> joinChildren(P&& predicate, const std::vector<U>& data);
+        
+        template <typename P, typename U>
+        ChildrenJoin<E,T,P,detail::SharedData<U>> joinChildren(P&& predicate, const std::vector<U>&& data) = delete;
+        
+        template <typename P, typename F, typename=detail::mapped_data_t<F,T>, typename=detail::enable_if_callables<F>>
+        ChildrenJoin<E,T,P,detail::MappedData<F>> joinChildren(P&& predicate, F&& mapping);
+        
+        enter_selection_type& enter();
+        exit_selection_type&  exit();
+        
+        // a transition of this selection's elements, scheduled by the
+        // document (see Transitions): add its channels with tween()
+        SelectionTransition<E,T> transition(double duration, ease::function_type ease=ease::cubic_in_out);
+        
+        selection_type&       call(call_type f);
+        
+        template <typename F, typename=detail::enable_if_callables<F>>
+        selection_type&       call(F&& f);
+        
+        // f(e, d) is called concurrently from several threads and in no
+        // particular order: it may only modify its own element e (and
+        // read d). returns after every element was visited
+        template <typename F>
+        selection_type&       call_parallel(F&& f);
+        
+        template <typename F>
+        selection_type&       call(const execution::Parallel &policy, F&& f);
+        
+        template <typename F>
+        selection_type&       call(execution::Sequential policy, F&& f);
+        
+        selection_type&       remove(remove_from_document_function_type remove_from_document_function);
+        
+        template <typename F, typename=detail::enable_if_callables<F>>
+        selection_type&       remove(F&& remove_from_document_function);
+        
+    public:
+        
+        enter_selection_type& _enterSelection_init(); // data per group mode
+        void                  _enterSelection_add(group_type* main_selection_group, int index, const std::vector<T>& group_data);  // data per group mode
+        void                  _enterSelection_add(group_type* main_selection_group, int index, std::vector<T>&& group_data);
+
+        enter_selection_type& _enterSelection_init(const std::vector<T>& shared_data); // shared data mode
+        enter_selection_type& _enterSelection_init(std::vector<T>&& shared_data);
+        void                  _enterSelection_add(group_type* main_selection_group, int index); // shared data mode
+
+        // throws if data bound by reference can no longer be read
+        void                  _check_data_guard() const;
+        
+        // appends source.groups[k] to the end of *targets[k] in one pass
+        // over the elements; targets must be in group order
+        void                  _append_to_groups(const std::vector<group_type*> &targets,
+                                                const selection_type &source);
+        
+    public:
+        exit_selection_type&  _exitSelection_init();
+        
+        template <typename S>
+        S&                    _scratch(std::unique_ptr<S> &local);
+        
+        // V is std::vector<U> (moved from) or const std::vector<U>&
+        template <typename V, typename U, typename K, typename E2K>
+        void                  _sorted_join_group(const group_type &g,
+                                                 V&& data,
+                                                 SortedJoinScratch<K> &scratch,
+                                                 E2K &elem2key,
+                                                 Selection<E,U> &result);
+        
+        // implementations shared by the std::function and the callable overloads
+        template <typename U>
+        Selection<E,U>        _data_index(std::vector<U>&& data);
+        
+        template <typename V, typename D2K, typename E2K, typename U=typename std::decay<V>::type::value_type>
+        Selection<E,U>        _data_keyed(V&& data, D2K &data2key, E2K &elem2key);
+        
+        template <typename U, typename F>
+        Selection<E,U>        _data_mapping(F &mapping);
+        
+        template <typename U, typename F, typename D2K, typename E2K>
+        Selection<E,U>        _data_mapping_keyed(F &mapping, D2K &data2key, E2K &elem2key);
+        
+        // join(chunk, group, data, group_join) joins one group into its
+        // task's chunk (see JoinChunk)
+        template <typename U, typename S, typename F, typename J>
+        Selection<E,U>        _data_mapping_parallel(const execution::Parallel &policy, F &mapping, J &&join,
+                                                     detail::PhaseScope<E> &scope);
+        
+        template <typename V, typename D2K, typename E2K, typename U=typename std::decay<V>::type::value_type>
+        Selection<E,U>        _data_sorted(V&& data, D2K &data2key, E2K &elem2key);
+        
+        template <typename U, typename F, typename D2K, typename E2K>
+        Selection<E,U>        _data_sorted_mapping(F &mapping, D2K &data2key, E2K &elem2key);
+        
+        template <typename P, typename G>
+        selection_type        _selectAll(P &predicate, G &gen_iterator);
+        
+        // adds the elements visitor matches below root (and root itself
+        // when include_root) to the last group. stack is scratch
+        template <typename V>
+        void                  _visit(E* root, bool include_root, V &visitor, std::vector<E*> &stack,
+                                     detail::PhaseScope<E> &scope);
+        
+        // result.groups[r] is the (empty) group of roots[r]
+        template <typename P, typename G>
+        static void           _selectAll_parallel(ThreadPool &pool,
+                                                  const std::vector<E*> &roots,
+                                                  P &predicate,
+                                                  G &gen_iterator,
+                                                  selection_type &result,
+                                                  detail::PhaseScope<E> &scope);
+        
+        template <typename F>
+        void                  _call(F &f);
+        
+        template <typename F>
+        void                  _call_parallel(const execution::Parallel &policy, F &f);
+        
+        void                  _notify_update(); // every element, if the document is observed
+        
+        ThreadPool&           _thread_pool(const execution::Parallel &policy);
+        
+        template <typename F>
+        void                  _remove(F &remove_from_document_function);
+        
+    public:
+        document_type *document { nullptr }; // source of reusable scratch buffers (optional)
+        std::shared_ptr<const DataGuard>      data_guard; // set when values are DataRefs
+        std::deque<group_type>                groups;   // deque: stable group addresses
+        std::vector<element_value_type>       elements; // all groups' elements, group after group
+        std::unique_ptr<enter_selection_type> enter_selection;
+        std::unique_ptr<exit_selection_type>  exit_selection;
+    };
+    
+    //------------------------------------------------------------------------------
+    // ExitSelection
+    //------------------------------------------------------------------------------
+    
+    // elements of a join without a datum: only the element pointers
+    // (grouped by parent) are kept, there is no data payload
+    
+    template <typename E>
+    struct ExitSelection {
+    public:
+        
+        using element_type         = E;
+        using exit_selection_type  = ExitSelection;
+        using group_type           = ExitGroup<E>;
+        using document_type        = Document<E>;
+        using range_type           = Range<E* const*>;
+        using call_type            = std::function<void(E*)>;
+        
+        using remove_from_document_function_type = std::function<void(E*)>;
+        
+    public:
+        
+        group_type&          _group_add(E* parent);
+        void                 _element_add(E* e); // to the last group
+        
+        range_type           elements_of(const group_type &g) const;
+        
+        std::size_t          size() const;
+        bool                 empty() const;
+        
+        exit_selection_type& call(call_type f);
+        
+        template <typename F, typename=detail::enable_if_callables<F>>
+        exit_selection_type& call(F&& f);
+        
+        // calls remove_from_document_function on every element and
+        // empties the selection
+        exit_selection_type& remove(remove_from_document_function_type remove_from_document_function);
+        
+        template <typename F, typename=detail::enable_if_callables<F>>
+        exit_selection_type& remove(F&& remove_from_document_function);
+        
+        // removes every element from the document through
+        // TreeTraits::erase_children: one compacting pass per parent
+        // (O(children) however many are removed) and no null slots
+        // left behind. only elements found among their parent's children
+        // are notified and erased. empties the selection
+        exit_selection_type& remove();
+        
+    public:
+        
+        template <typename F>
+        void                 _call(F &f);
+        
+        template <typename F>
+        void                 _remove(F &remove_from_document_function);
+        
+    public:
+        document_type *document { nullptr };
+        std::vector<group_type> groups;
+        std::vector<E*>         elements;
+    };
+    
+    
+    //------------------------------------------------------------------------------
+    // Document
+    //------------------------------------------------------------------------------
+    
+    template <typename E>
+    struct Document {
+        using predicate_type       = std::function<bool(const E*)>;
+        using selection_type       = Selection<E,int>;
+        
+    public:
+        Document() = default;
+        Document(E* root);
+        
+        template <typename I> // can add additional constraint of how to search for children
+        selection_type selectAll(predicate_type p, std::function<I(E*)> gen_iterator);
+        
+        template <typename P, typename G, typename=detail::enable_if_callables<P,G>>
+        selection_type selectAll(P&& p, G&& gen_iterator);
+        
+        // see Selection::selectAll(policy, ...): the root subtree is split
+        // into pieces traversed concurrently
+        template <typename P, typename G>
+        selection_type selectAll(const execution::Parallel &policy, P&& p, G&& gen_iterator);
+        
+        template <typename P, typename G>
+        selection_type _selectAll(P &predicate, G &gen_iterator);
+        
+        // see Selection::selectAll(visitor); the root is visited too
+        template <typename V>
+        selection_type selectAll(V&& visitor);
+        
+        // one instance of S per document, kept alive (with its capacity)
+        // across joins; not thread safe
+        template <typename S>
+        S& scratch();
+        
+        // pool of the parallel operations on this document's selections;
+        // created on first use unless one was given
+        ThreadPool& thread_pool();
+        void        thread_pool(std::shared_ptr<ThreadPool> pool);
+        
+        // observers are told about every element appended or removed
+        // through this document's selections
+        void observe(DocumentObserver<E> *observer);
+        void unobserve(DocumentObserver<E> *observer);
+        
+        void _notify_append(E* parent, E* element);
+        void _notify_remove(E* element);
+        void _notify_update(E* element);
+        bool _observed() const;
+        
+        // builds (or rebuilds) the tag index: one document order list of
+        // elements per tag, kept current like a LiveSelection
+        TagIndex<E>&   index_tags(std::function<std::string(const E*)> tag_function);
+        
+        // elements with the given tag (root included), from the tag index
+        selection_type selectTag(const std::string &tag);
+        
+        // same, keeping the elements accepted by predicate (e.g. an
+        // attribute test): O(elements with the tag) instead of O(document)
+        template <typename P>
+        selection_type selectTag(const std::string &tag, P&& predicate);
+        
+        // one group with the root as parent holding elements
+        selection_type _selection(const std::vector<E*> &elements);
+        
+        TagIndex<E>&   _tags(); // throws std::runtime_error without index
+        
+        // scheduler of this document's transitions; created on first use
+        Transitions<E>& transitions();
+        
+        // snapshot of the counters and timings since construction or the
+        // last reset_stats(); all 0 unless compiled with D3CPP_STATS
+        Stats stats() const;
+        void  reset_stats();
+        
+        E *root { nullptr };
+        std::shared_ptr<ThreadPool> pool;
+        std::unordered_map<std::type_index, std::shared_ptr<void>> scratch_buffers;
+        std::vector<DocumentObserver<E>*> observers;
+        // optional TagIndex<E>, held as an observer so that Document<E>
+        // doesn't instantiate it (nor its TreeTraits needs) unless
+        // index_tags() is called; after observers (unobserves on destruction)
+        std::unique_ptr<DocumentObserver<E>> tag_index;
+        std::unique_ptr<DocumentObserver<E>> scheduler; // Transitions<E>, same as tag_index (transitions())
+        Stats                             counters;
+    };
+    
+    //------------------------------------------------------------------------------
+    // OrderedElements
+    //------------------------------------------------------------------------------
+    
+    // elements in document order with buffered inserts and erases. erased
+    // elements are never dereferenced again, so they can be destroyed
+    // right after erase(). pending changes are applied by elements():
+    // erased ones are dropped, inserted ones sorted (TreeTraits document
+    // order) and merged in; usually they all go after the last element.
+    
+    template <typename E>
+    struct OrderedElements {
+        
+        void insert(E* e);
+        void erase(E* e);
+        
+        // e must come after every element (e.g. seeding in pre-order)
+        void push_back(E* e);
+        
+        const std::vector<E*>& elements();
+        
+        std::vector<E*>         ordered;  // document order (once synced)
+        std::unordered_set<E*>  inserted; // not yet merged
+        std::unordered_set<E*>  erased;   // to drop from ordered
+        std::vector<E*>         buffer;
+    };
+    
+    //------------------------------------------------------------------------------
+    // LiveSelection
+    //------------------------------------------------------------------------------
+    
+    // elements of a document matching a predicate, kept in document order
+    // and updated from the document's append/remove notifications, so a
+    // frame can start from selection() instead of a selectAll traversal.
+    // changes are buffered (O(size of the appended/removed subtrees)) and
+    // applied by the next elements()/selection() call. elements changed
+    // behind d3cpp's back are not tracked.
+    
+    template <typename E>
+    struct LiveSelection: public DocumentObserver<E> {
+    public:
+        
+        using document_type  = Document<E>;
+        using predicate_type = std::function<bool(const E*)>;
+        using selection_type = Selection<E,int>;
+        
+    public:
+        
+        // seeds with a pre-order traversal of the document root (included)
+        LiveSelection(document_type &document, predicate_type predicate);
+        ~LiveSelection();
+        
+        LiveSelection(const LiveSelection&) = delete;
+        LiveSelection& operator=(const LiveSelection&) = delete;
+        
+        const std::vector<E*>& elements();
+        
+        // one group with the document root as parent, like Document::selectAll
+        selection_type         selection();
+        
+        void on_append(E* parent, E* element) override;
+        void on_remove(E* element) override;
+        
+    public:
+        document_type           &document;
+        predicate_type          predicate;
+        OrderedElements<E>      matches;
+    };
+    
+    //------------------------------------------------------------------------------
+    // TagIndex
+    //------------------------------------------------------------------------------
+    
+    // one OrderedElements per interned tag. tags are read once when an
+    // element is added and must not change while the element is indexed
+    
+    template <typename E>
+    struct TagIndex: public DocumentObserver<E> {
+    public:
+        
+        using document_type     = Document<E>;
+        using tag_function_type = std::function<std::string(const E*)>;
+        
+        static const std::uint32_t none = ~std::uint32_t(0);
+        
+    public:
+        
+        TagIndex(document_type &document, tag_function_type tag_function);
+        ~TagIndex();
+        
+        TagIndex(const TagIndex&) = delete;
+        TagIndex& operator=(const TagIndex&) = delete;
+        
+        std::uint32_t          intern(const std::string &tag);
+        std::uint32_t          find(const std::string &tag) const; // none if never seen
+        
+        // elements with tag in document order
+        const std::vector<E*>& elements(const std::string &tag);
+        
+        void on_append(E* parent, E* element) override;
+        void on_remove(E* element) override;
+        
+    public:
+        document_type                                   &document;
+        tag_function_type                               tag_function;
+        std::unordered_map<std::string, std::uint32_t> tag_ids;
+        std::vector<OrderedElements<E>>                 lists;   // per tag id
+        std::vector<E*>                                 empty;
+    };
+    
+    //------------------------------------------------------------------------------
+    // Journal
+    //------------------------------------------------------------------------------
+    
+    // records the changes of a document between checkpoints: appends,
+    // removals and updates (call() callbacks) made through d3cpp. every
+    // element gets a stable id (the tree in pre-order first, then in
+    // append order) so a remote copy can be patched. the cost of a
+    // patch scales with the changes, not with the document.
+    //
+    // patch() writes one change per line and checkpoints:
+    //
+    //     - <id>                                removed, with its subtree
+    //     + <id> <parent id> <index> <content>  appended, parents first
+    //     ~ <id> <content>                      updated
+    //
+    // removals come first, then appends in order, then updates. index
+    // is TreeTraits::index() and content whatever
+    // write_element(const E*, std::string&) appends. elements appended
+    // and removed within the same frame are left out, and appended
+    // elements are not reported as updated.
+    
+    template <typename E>
+    struct Journal: public DocumentObserver<E> {
+    public:
+        
+        using document_type = Document<E>;
+        using id_type       = std::uint64_t;
+        
+        enum Op: unsigned char { APPEND, REMOVE, UPDATE };
+        
+        struct Change {
+            Op      op;
+            id_type id;
+            E*      element; // nullptr for REMOVE
+        };
+        
+    public:
+        
+        Journal(document_type &document);
+        ~Journal();
+        
+        Journal(const Journal&) = delete;
+        Journal& operator=(const Journal&) = delete;
+        
+        id_type id(E* element) const; // throws for elements not in the document
+        
+        template <typename F>
+        void patch(std::string &out, F&& write_element);
+        
+        void checkpoint(); // forgets the changes so far
+        
+        void on_append(E* parent, E* element) override;
+        void on_remove(E* element) override;
+        void on_update(E* element) override;
+        
+    public:
+        document_type                           &document;
+        std::unordered_map<E*, id_type>         ids;
+        id_type                                 next_id { 0 };
+        id_type                                 frame_id { 0 }; // ids >= frame_id were appended since the checkpoint
+        std::vector<Change>                     changes;
+        std::unordered_set<id_type>             removed; // since the checkpoint, subtrees included
+        std::unordered_set<id_type>             reported;
+    };
+    
+    //------------------------------------------------------------------------------
+    // Transition
+    //------------------------------------------------------------------------------
+    
+    // numeric channels of a set of elements interpolated over time. the
+    // values live in structure of arrays buffers, one entry per element
+    // and channel: a tick computes a whole channel in one vectorizable
+    // loop and calls the channel's setter only for the values that
+    // changed since the last tick.
+    
+    template <typename E>
+    struct Transition {
+    public:
+        
+        using set_type = std::function<void(E*, double)>;
+        
+        struct Channel {
+            set_type            set;
+            std::vector<double> from;
+            std::vector<double> delta; // to - from
+            std::vector<double> last;  // last value written (NaN: none yet)
+        };
+        
+    public:
+        
+        Transition(std::vector<E*> elements, double duration, ease::function_type ease);
+        
+        // from(i), to(i) for elements[i]
+        template <typename From, typename To>
+        Channel& add_channel(From&& from, To&& to, set_type set);
+        
+        // the transition starts (plus delay) at the first tick. returns
+        // false once the end values were written
+        bool tick(double now);
+        
+        // forgets the elements removed (removed[e]: time of the last
+        // removal of e) after this transition was created
+        void _drop(const std::unordered_map<E*, std::uint64_t> &removed);
+        
+    public:
+        std::vector<E*>      elements;
+        std::vector<Channel> channels;
+        std::vector<double>  values;  // scratch of tick
+        double               duration { 0 };
+        double               delay    { 0 };
+        ease::function_type  ease     { ease::cubic_in_out };
+        double               start    { 0 };
+        bool                 started  { false };
+        std::uint64_t        created  { 0 }; // Transitions::clock
+    };
+    
+    //------------------------------------------------------------------------------
+    // Transitions
+    //------------------------------------------------------------------------------
+    
+    // a document's active transitions, advanced together by tick(now).
+    // now is any clock (e.g. seconds) shared with the durations. while
+    // transitions are active it observes the document so that removed
+    // elements are never written to. removals are applied at the next
+    // tick, to the transitions created before them: an element appended
+    // at a removed one's address (e.g. by an ElementPool) in between is
+    // kept by a newer transition. a later transition does not
+    // interrupt an earlier one on the same elements: both write, in
+    // the order they were created
+    
+    template <typename E>
+    struct Transitions: public DocumentObserver<E> {
+    public:
+        
+        using document_type = Document<E>;
+        
+    public:
+        
+        Transitions(document_type &document);
+        ~Transitions();
+        
+        Transitions(const Transitions&) = delete;
+        Transitions& operator=(const Transitions&) = delete;
+        
+        Transition<E>& add(std::vector<E*> elements, double duration, ease::function_type ease);
+        
+        // advances every active transition; false once none is left
+        bool        tick(double now);
+        std::size_t size() const;
+        
+        void on_append(E* parent, E* element) override;
+        void on_remove(E* element) override;
+        
+    public:
+        document_type                               &document;
+        std::vector<std::unique_ptr<Transition<E>>> active;
+        std::unordered_map<E*, std::uint64_t>       removed; // since the last tick, with their time
+        std::uint64_t                               clock { 0 }; // counts adds and removals
+        bool                                        observing { false };
+    };
+    
+    //------------------------------------------------------------------------------
+    // SelectionTransition
+    //------------------------------------------------------------------------------
+    
+    // Selection::transition(): channels read the elements' data
+    
+    template <typename E, typename T>
+    struct SelectionTransition {
+    public:
+        
+        using selection_type  = Selection<E,T>;
+        using transition_type = Transition<E>;
+        
+    public:
+        
+        SelectionTransition(selection_type &selection, transition_type &transition);
+        
+        // one channel: from(E*, const T&) and to(E*, const T&) are read
+        // now, set(E*, double) is called by the ticks
+        template <typename From, typename To, typename Set>
+        SelectionTransition& tween(From&& from, To&& to, Set&& set);
+        
+        SelectionTransition& delay(double delay);
+        
+    public:
+        selection_type  &selection;
+        transition_type &transition;
+    };
+    
+    //------------------------------------------------------------------------------
+    // ChildrenJoin
+    //------------------------------------------------------------------------------
+    
+    // Selection::joinChildren(): a fused index join of the children of
+    // every element of a selection, evaluated by call(f). each element
+    // is handled in one pass over its children: the i-th child accepted
+    // by the predicate gets f(child, data[i]); with enter(a) the missing
+    // children are appended by a(parent, d) and updated by f too (d3's
+    // enter + update merge); with exit(x) the surplus children are
+    // visited by x(child), and removed from the tree after remove().
+    // no selection or enter/exit buffer is built. enter and exit are
+    // part of the type: an unused stage costs nothing. parents and
+    // shared data are held by reference, mappings by value: keep the
+    // selection and the data alive until call() returns.
+    //
+    //     lists.joinChildren(is_item, data)
+    //          .enter([](E* parent, const U& d) { return &parent->append("item"); })
+    //          .remove()
+    //          .call([](E* e, const U& d) { ... });
+    
+    namespace detail {
+        
+        struct NoEnter {
+            template <typename X, typename D>
+            X operator()(X, const D&) const { return nullptr; }
+        };
+        
+        struct NoExit {
+            template <typename X>
+            void operator()(X) const {}
+        };
+        
+        template <typename U>
+        struct SharedData {
+            template <typename V>
+            const std::vector<U>& operator()(const V&) const { return data; }
+            const std::vector<U> &data;
+        };
+        
+        template <typename F>
+        struct MappedData {
+            template <typename V>
+            auto operator()(const V& parent) -> decltype(std::declval<F&>()(parent.value)) { return mapping(parent.value); }
+            F mapping;
+        };
+        
+    } // detail
+    
+    // elements updated, appended and exiting (removed or not) by call()
+    struct ChildrenJoinCount {
+        std::size_t update { 0 };
+        std::size_t enter  { 0 };
+        std::size_t exit   { 0 };
+    };
+    
+    template <typename E, typename T, typename P, typename D, typename A, typename X>
+    struct ChildrenJoin {
+    public:
+        
+        using selection_type     = Selection<E,T>;
+        using element_value_type = ElementValue<E,T>;
+        using data_vector_type   = typename std::decay<decltype(std::declval<D&>()(std::declval<const element_value_type&>()))>::type;
+        using data_type          = typename data_vector_type::value_type;
+        
+        static constexpr bool entering = !std::is_same<A, detail::NoEnter>::value;
+        static constexpr bool exiting  = !std::is_same<X, detail::NoExit>::value;
+        
+    public:
+        
+        ChildrenJoin(selection_type &parents, P predicate, D data, A append, X exit, bool removing);
+        
+        template <typename A2>
+        ChildrenJoin<E,T,P,D,typename std::decay<A2>::type,X> enter(A2&& append);
+        
+        template <typename X2>
+        ChildrenJoin<E,T,P,D,A,typename std::decay<X2>::type> exit(X2&& exit);
+        
+        // the surplus children are removed (after exit(x) visited them)
+        ChildrenJoin& remove();
+        
+        // runs the join: f(E*, const data_type&)
+        template <typename F>
+        ChildrenJoinCount call(F&& f);
+        
+    public:
+        selection_type &parents;
+        P               predicate;
+        D               data;
+        A               append;
+        X               exit_function;
+        bool            removing { false };
+    };
+    
+    //------------------------------------------------------------------------------
+    // EnterSelection
+    //------------------------------------------------------------------------------
+    
+    template <typename E, typename T>
+    struct EnterSelection {
+        
+        enum Mode { SINGLE_SHARED_LIST, ONE_LIST_PER_GROUP };
+        
+        using group_type           = Group<E, T>;
+        using selection_type       = Selection<E, T>;
+        using enter_selection_type = EnterSelection<E, T>;
+        using append_function_type = std::function<E*(E*, const T&)>;
+        using data_range_type      = Range<typename std::vector<T>::const_iterator>;
+        
+        struct Entry {
+            Entry() = default;
+            Entry(group_type* group, int index);
+            group_type*  group;
+            int          index;
+        };
+        
+        EnterSelection(selection_type *update_selection); // one list per group mode
+        EnterSelection(selection_type *update_selection, const std::vector<T> &enter_data); // shared list mode
+        EnterSelection(selection_type *update_selection, std::vector<T> &&enter_data); // shared list mode
+        
+        enter_selection_type& _add(group_type* update_selection_group, int index);
+        enter_selection_type& _add(group_type* update_selection_group, int index, const std::vector<T> &enter_data);
+        enter_selection_type& _add(group_type* update_selection_group, int index, std::vector<T> &&enter_data);
+        
+        // append consumes the enter data: the data are moved into the
+        // returned selection and copied into the update selection. a
+        // second append appends nothing
+        selection_type        append(append_function_type a);
+        
+        template <typename F, typename=detail::enable_if_callables<F>>
+        selection_type        append(F&& a);
+        
+        // same, calling append(parent, data, appended) once per group
+        // with all its entering data (data_range_type). it pushes one
+        // new child per datum, in data order, onto appended
+        // (std::vector<E*>&, empty on entry), so children can be made in
+        // one pass. both appends first call TreeTraits::reserve_children
+        template <typename F>
+        selection_type        append_bulk(F&& append);
+        
+        template <typename F>
+        selection_type        _append(F &append);
+        
+    public:
+        // there are two modes
+        Mode mode;
+        selection_type *update_selection;
+        std::vector<Entry>          entries;
+        std::vector<std::vector<T>> enter_data;
+    };
+    
+    //------------------------------------------------------------------------------
+    // ElementValue Impl.
+    //------------------------------------------------------------------------------
+    
+    template <typename E, typename T>
+    ElementValue<E,T>::ElementValue(E* element):
+    element(element)
+    {}
+    
+    template <typename E, typename T>
+    ElementValue<E,T>::ElementValue(E* element, T value):
+    element(element),
+    value(std::move(value))
+    {}
+    
+    //------------------------------------------------------------------------------
+    // Range Impl.
+    //------------------------------------------------------------------------------
+    
+    template <typename It>
+    It Range<It>::begin() const {
+        return first;
+    }
+    
+    template <typename It>
+    It Range<It>::end() const {
+        return last;
+    }
+    
+    template <typename It>
+    std::size_t Range<It>::size() const {
+        return last - first;
+    }
+    
+    template <typename It>
+    bool Range<It>::empty() const {
+        return first == last;
+    }
+    
+    template <typename It>
+    auto Range<It>::operator[](std::size_t i) const -> decltype(*std::declval<It>()) {
+        return first[i];
+    }
+    
+    //------------------------------------------------------------------------------
+    // Group Impl.
+    //------------------------------------------------------------------------------
+    
+    template <typename E, typename T>
+    Group<E,T>::Group(element_value_type parent, std::size_t offset):
+    parent(parent),
+    offset(offset)
+    {}
+    
+    //------------------------------------------------------------------------------
+    // ExitGroup Impl.
+    //------------------------------------------------------------------------------
+    
+    template <typename E>
+    ExitGroup<E>::ExitGroup(E* parent, std::size_t offset):
+    parent(parent),
+    offset(offset)
+    {}
+    
+    //------------------------------------------------------------------------------
+    // DataRef Impl.
+    //------------------------------------------------------------------------------
+    
+    template <typename U>
+    DataRef<U>::DataRef(const U* datum):
+    datum(datum)
+    {}
+    
+    template <typename U>
+    const U& DataRef<U>::get() const {
+        return *datum;
+    }
+    
+    template <typename U>
+    DataRef<U>::operator const U&() const {
+        return *datum;
+    }
+    
+    //------------------------------------------------------------------------------
+    // DataSpan Impl.
+    //------------------------------------------------------------------------------
+    
+    template <typename U>
+    bool DataSpan<U>::Guard::valid() const {
+        return alive && source->data() == first && source->size() == size;
+    }
+    
+    template <typename U>
+    DataSpan<U>::DataSpan(const std::vector<U> &source):
+    source(source),
+    guard(std::make_shared<Guard>())
+    {
+        refs.reserve(source.size());
+        for (auto &datum: source)
+            refs.push_back(&datum);
+        guard->source = &source;
+        guard->first  = source.data();
+        guard->size   = source.size();
+    }
+    
+    template <typename U>
+    DataSpan<U>::~DataSpan() {
+        guard->alive = false;
+    }
+    
+    template <typename U>
+    std::size_t DataSpan<U>::size() const {
+        return refs.size();
+    }
+    
+    //------------------------------------------------------------------------------
+    // execution policies Impl.
+    //------------------------------------------------------------------------------
+    
+    inline execution::Parallel::Parallel(ThreadPool *pool, std::size_t grain):
+    pool(pool),
+    grain(grain)
+    {}
+    
+    inline ThreadPool& default_thread_pool() {
+        static ThreadPool pool;
+        return pool;
+    }
+    
+    //------------------------------------------------------------------------------
+    // TreeTraits Impl.
+    //------------------------------------------------------------------------------
+    
+    template <typename E>
+    template <typename F>
+    void TreeTraits<E>::for_each_child(E* e, F&& f) {
+        for (auto &c: e->children) {
+            if (auto child = pointer(c))
+                f(child);
+        }
+    }
+    
+    template <typename E>
+    bool TreeTraits<E>::has_children(E* e) {
+        for (auto &c: e->children) {
+            if (pointer(c))
+                return true;
+        }
+        return false;
+    }
+    
+    template <typename E>
+    E* TreeTraits<E>::parent(E* e) {
+        return e->parent;
+    }
+    
+    template <typename E>
+    std::size_t TreeTraits<E>::index(E* e) {
+        return (std::size_t) e->parent_index;
+    }
+    
+    template <typename E>
+    template <typename F>
+    void TreeTraits<E>::for_each_in_subtree(E* e, F&& f) {
+        std::vector<E*> stack { e };
+        while (!stack.empty()) {
+            auto x = stack.back();
+            stack.pop_back();
+            f(x);
+            auto mark = stack.size();
+            for_each_child(x, [&stack](E* child) { stack.push_back(child); });
+            std::reverse(stack.begin() + mark, stack.end());
+        }
+    }
+    
+    template <typename E>
+    bool TreeTraits<E>::document_order(E* a, E* b) {
+        if (a == b)
+            return false;
+        
+        std::size_t depth_a = 0, depth_b = 0;
+        for (auto x = parent(a);x;x = parent(x))
+            ++depth_a;
+        for (auto x = parent(b);x;x = parent(x))
+            ++depth_b;
+        
+        // an ancestor comes before its descendants
+        for (;depth_a > depth_b;--depth_a) {
+            a = parent(a);
+            if (a == b)
+                return false;
+        }
+        for (;depth_b > depth_a;--depth_b) {
+            b = parent(b);
+            if (b == a)
+                return true;
+        }
+        
+        // siblings below the closest common ancestor
+        while (parent(a) != parent(b)) {
+            a = parent(a);
+            b = parent(b);
+        }
+        return index(a) < index(b);
+    }
+    
+    template <typename E>
+    template <typename F>
+    void TreeTraits<E>::erase_children(E* e, F&& is_removed) {
+        auto &children = e->children;
+        std::size_t kept = 0;
+        for (std::size_t i=0;i<children.size();++i) {
+            auto child = pointer(children[i]);
+            if (!child || is_removed(child))
+                continue;
+            child->parent_index = (decltype(child->parent_index)) kept;
+            if (kept != i)
+                children[kept] = std::move(children[i]);
+            ++kept;
+        }
+        children.erase(children.begin() + kept, children.end());
+    }
+    
+    namespace detail {
+        
+        // TreeTraits::reserve_children: int is preferred over long, the
+        // first overload drops out when E has no reservable children
+        template <typename E>
+        auto reserve_children(E* e, std::size_t count, int) -> decltype(e->children.reserve(e->children.capacity()), void()) {
+            auto &children = e->children;
+            auto needed = children.size() + count;
+            if (children.capacity() < needed)
+                children.reserve(std::max(needed, 2 * children.capacity()));
+        }
+        
+        template <typename E>
+        void reserve_children(E*, std::size_t, long) {}
+        
+    }
+    
+    template <typename E>
+    void TreeTraits<E>::reserve_children(E* e, std::size_t count) {
+        detail::reserve_children(e, count, 0);
+    }
+    
+    template <typename E>
+    E* TreeTraits<E>::pointer(E* child) {
+        return child;
+    }
+    
+    template <typename E>
+    template <typename P>
+    E* TreeTraits<E>::pointer(const P& child) {
+        return child.get();
+    }
+    
+    //------------------------------------------------------------------------------
+    // AttributeTraits Impl.
+    //------------------------------------------------------------------------------
+    
+    template <typename E>
+    template <typename K>
+    detail::attribute_key_t<E,K> AttributeTraits<E>::key(const K& key) {
+        return detail::attribute_key_t<E,K>(key);
+    }
+    
+    template <typename E>
+    template <typename K>
+    void AttributeTraits<E>::set_number(E* e, const K& key, double value) {
+        e->attr(key, value);
+    }
+    
+    //------------------------------------------------------------------------------
+    // scale Impl.
+    //------------------------------------------------------------------------------
+    
+    namespace scale {
+        
+        inline Clamp::Clamp(double lo, double hi):
+        lo(std::min(lo, hi)),
+        hi(std::max(lo, hi))
+        {}
+        
+        inline double Clamp::operator()(double v) const {
+            return std::min(hi, std::max(lo, v));
+        }
+        
+        inline void Clamp::apply(double *values, std::size_t n) const {
+            auto lo = this->lo, hi = this->hi;
+            for (std::size_t i=0;i<n;++i)
+                values[i] = std::min(hi, std::max(lo, values[i]));
+        }
+        
+        inline Linear::Linear(double d0, double d1, double r0, double r1):
+        d0(d0),
+        r0(r0),
+        k(d1 != d0 ? (r1 - r0) / (d1 - d0) : 0),
+        lo(std::min(r0, r1)),
+        hi(std::max(r0, r1))
+        {}
+        
+        inline Linear& Linear::clamp(bool clamp) {
+            clamped = clamp;
+            return *this;
+        }
+        
+        inline double Linear::operator()(double v) const {
+            v = r0 + (v - d0) * k;
+            return clamped ? std::min(hi, std::max(lo, v)) : v;
+        }
+        
+        inline void Linear::apply(double *values, std::size_t n) const {
+            // locals: the stores to values could otherwise alias the members
+            auto d0 = this->d0, r0 = this->r0, k = this->k;
+            for (std::size_t i=0;i<n;++i)
+                values[i] = r0 + (values[i] - d0) * k;
+            if (clamped)
+                Clamp(lo, hi).apply(values, n);
+        }
+        
+        inline Log::Log(double d0, double d1, double r0, double r1):
+        linear(std::log(d0), std::log(d1), r0, r1)
+        {}
+        
+        inline Log& Log::clamp(bool clamp) {
+            linear.clamp(clamp);
+            return *this;
+        }
+        
+        inline double Log::operator()(double v) const {
+            return linear(std::log(v));
+        }
+        
+        inline void Log::apply(double *values, std::size_t n) const {
+            for (std::size_t i=0;i<n;++i)
+                values[i] = std::log(values[i]);
+            linear.apply(values, n);
+        }
+        
+    } // scale
+    
+    //------------------------------------------------------------------------------
+    // TreeIterator Impl.
+    //------------------------------------------------------------------------------
+    
+    template <typename E>
+    TreeIterator<E>::TreeIterator(E* root):
+    stack { root }
+    {}
+    
+    template <typename E>
+    void TreeIterator<E>::reset(E* root) {
+        stack.clear();
+        stack.push_back(root);
+    }
+    
+    template <typename E>
+    E* TreeIterator<E>::next() {
+        if (stack.empty())
+            return nullptr;
+        auto e = stack.back();
+        stack.pop_back();
+        auto mark = stack.size();
+        TreeTraits<E>::for_each_child(e, [this](E* child) { stack.push_back(child); });
+        std::reverse(stack.begin() + mark, stack.end());
+        return e;
+    }
+    
+    //------------------------------------------------------------------------------
+    // Stats Impl.
+    //------------------------------------------------------------------------------
+    
+    inline const char* Stats::phase_name(Phase phase) {
+        static const char* names[NUM_PHASES] = { "select", "data", "append", "remove", "call" };
+        return names[phase];
+    }
+    
+    //------------------------------------------------------------------------------
+    // Tracer Impl.
+    //------------------------------------------------------------------------------
+    
+    inline Tracer::Ring::Ring(std::uint32_t tid):
+    events(CAPACITY),
+    tid(tid)
+    {}
+    
+    inline void Tracer::Ring::push(const Event &event) {
+        auto h = head.load(std::memory_order_relaxed);
+        events[h & (CAPACITY - 1)] = event;
+        head.store(h + 1, std::memory_order_release);
+    }
+    
+    inline Tracer& Tracer::global() {
+        static Tracer tracer;
+        return tracer;
+    }
+    
+    inline void Tracer::start() {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto &ring: rings)
+            ring->head.store(0, std::memory_order_relaxed);
+        epoch = std::chrono::steady_clock::now();
+        recording.store(true, std::memory_order_release);
+    }
+    
+    inline void Tracer::stop() {
+        recording.store(false, std::memory_order_release);
+    }
+    
+    inline bool Tracer::active() const {
+        return recording.load(std::memory_order_acquire);
+    }
+    
+    inline std::uint64_t Tracer::now() const {
+        return (std::uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+    }
+    
+    inline auto Tracer::ring() -> Ring& {
+        // one registration per thread (of the single tracer); the rings
+        // outlive the tracer's users
+        thread_local Ring *local = nullptr;
+        if (!local) {
+            std::lock_guard<std::mutex> lock(mutex);
+            rings.emplace_back(new Ring((std::uint32_t) rings.size()));
+            local = rings.back().get();
+        }
+        return *local;
+    }
+    
+    inline void Tracer::write_json(std::ostream &os) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        os << "{\"traceEvents\":[";
+        bool first = true;
+        char buffer[64];
+        for (auto &ring: rings) {
+            auto end   = ring->head.load(std::memory_order_acquire);
+            auto begin = end > Ring::CAPACITY ? end - Ring::CAPACITY : 0;
+            for (auto i=begin;i<end;++i) {
+                auto &event = ring->events[i & (Ring::CAPACITY - 1)];
+                os << (first ? "\n" : ",\n") << "{\"name\":\"" << event.name << "\",\"cat\":\"d3cpp\",\"ph\":\"X\",";
+                std::snprintf(buffer, sizeof(buffer), "\"ts\":%.3f,\"dur\":%.3f,", event.begin / 1000.0, event.duration / 1000.0);
+                os << buffer << "\"pid\":1,\"tid\":" << ring->tid;
+                if (event.arg >= 0)
+                    os << ",\"args\":{\"n\":" << event.arg << "}";
+                os << "}";
+                first = false;
+            }
+        }
+        os << "\n]}\n";
+    }
+    
+    namespace detail {
+        
+        inline TraceScope::TraceScope(const char *name, std::int64_t arg):
+        arg(arg)
+        {
+            if (Tracer::enabled && Tracer::global().active()) {
+                this->name  = name;
+                this->begin = Tracer::global().now();
+            }
+        }
+        
+        inline TraceScope::~TraceScope() {
+            if (Tracer::enabled && name) {
+                auto &tracer = Tracer::global();
+                tracer.ring().push({ name, begin, tracer.now() - begin, arg });
+            }
+        }
+        
+    } // detail
+    
+    //------------------------------------------------------------------------------
+    // KeyIndex Impl.
+    //------------------------------------------------------------------------------
+    
+    template <typename K, typename Hash>
+    const std::size_t KeyIndex<K,Hash>::npos;
+    
+    template <typename K, typename Hash>
+    std::size_t KeyIndex<K,Hash>::hash(const K& key) const {
+        return hasher(key);
+    }
+    
+    template <typename K, typename Hash>
+    void KeyIndex<K,Hash>::clear() {
+        count = 0;
+        if (++epoch == 0) { // wrapped around: stale epochs could look live
+            for (auto &slot: slots)
+                slot.epoch = 0;
+            epoch = 1;
+        }
+    }
+    
+    template <typename K, typename Hash>
+    void KeyIndex<K,Hash>::reserve(std::size_t n) {
+        // keep the load factor at or below 1/2
+        std::size_t capacity = slots.empty() ? 16 : slots.size();
+        while (capacity < 2 * n)
+            capacity *= 2;
+        if (capacity > slots.size())
+            _rehash(capacity);
+    }
+    
+    template <typename K, typename Hash>
+    void KeyIndex<K,Hash>::_rehash(std::size_t capacity) {
+        std::vector<Slot> old_slots(capacity);
+        old_slots.swap(slots);
+        auto old_epoch = epoch;
+        auto counted   = std::make_pair(lookups, collisions);
+        mask  = capacity - 1;
+        count = 0;
+        epoch = 1;
+        for (auto &slot: old_slots) {
+            if (slot.epoch == old_epoch)
+                insert(std::move(slot.key), slot.hash, slot.value);
+        }
+        std::tie(lookups, collisions) = counted;
+    }
+    
+    template <typename K, typename Hash>
+    std::size_t KeyIndex<K,Hash>::insert(K key, std::size_t hash, std::size_t value) {
+        if (2 * (count + 1) > slots.size())
+            _rehash(slots.empty() ? 16 : 2 * slots.size());
+        if (Stats::enabled)
+            ++lookups;
+        auto i = hash & mask;
+        while (true) {
+            auto &slot = slots[i];
+            if (slot.epoch != epoch) {
+                slot.hash  = hash;
+                slot.value = value;
+                slot.epoch = epoch;
+                slot.key   = std::move(key);
+                ++count;
+                return npos;
+            }
+            else if (slot.hash == hash && slot.key == key) {
+                auto previous = slot.value;
+                slot.value = value;
+                return previous;
+            }
+            if (Stats::enabled)
+                ++collisions;
+            i = (i + 1) & mask;
+        }
+    }
+    
+    template <typename K, typename Hash>
+    std::size_t* KeyIndex<K,Hash>::find(const K& key, std::size_t hash) {
+        if (Stats::enabled)
+            ++lookups;
+        if (!count)
+            return nullptr;
+        auto i = hash & mask;
+        while (true) {
+            auto &slot = slots[i];
+            if (slot.epoch != epoch)
+                return nullptr;
+            else if (slot.hash == hash && slot.key == key)
+                return &slot.value;
+            if (Stats::enabled)
+                ++collisions;
+            i = (i + 1) & mask;
+        }
+    }
+    
+    template <typename K, typename Hash>
+    std::size_t KeyIndex<K,Hash>::size() const {
+        return count;
+    }
+    
+    template <typename K, typename Hash>
+    std::size_t KeyIndex<K,Hash>::capacity() const {
+        return slots.size() / 2;
+    }
+    
+    //------------------------------------------------------------------------------
+    // KeyedJoinScratch Impl.
+    //------------------------------------------------------------------------------
+    
+    template <typename K>
+    void KeyedJoinScratch<K>::reset(std::size_t n) {
+        index.clear();
+        index.reserve(n);
+        state.assign(n, SHADOWED);
+        available = 0;
+    }
+    
+    //------------------------------------------------------------------------------
+    // SortedJoinScratch Impl.
+    //------------------------------------------------------------------------------
+    
+    template <typename K>
+    const std::uint32_t SortedJoinScratch<K>::none;
+    
+    template <typename K>
+    void SortedJoinScratch<K>::sort(std::vector<entry_type> &keys) {
+        _sort(keys, std::integral_constant<bool, std::is_integral<K>::value>());
+    }
+    
+    template <typename K>
+    void SortedJoinScratch<K>::_sort(std::vector<entry_type> &keys, std::false_type) {
+        std::sort(keys.begin(), keys.end(), [](const entry_type &a, const entry_type &b) {
+            return a.first < b.first || (!(b.first < a.first) && a.second < b.second);
+        });
+    }
+    
+    template <typename K>
+    void SortedJoinScratch<K>::_sort(std::vector<entry_type> &keys, std::true_type) {
+        // LSD radix sort on the order preserving unsigned image of the key;
+        // stable, so equal keys keep their original order
+        auto image = [](K k) -> std::uint64_t {
+            auto u = static_cast<std::uint64_t>(k);
+            return std::is_signed<K>::value ? u ^ (std::uint64_t(1) << 63) : u;
+        };
+        
+        // keys of a previous frame are often already in order
+        auto sorted = std::is_sorted(keys.begin(), keys.end(), [](const entry_type &a, const entry_type &b) {
+            return a.first < b.first;
+        });
+        if (sorted)
+            return;
+        
+        // all eight digit histograms in a single pass
+        std::size_t count[8][256] = { { 0 } };
+        for (auto &e: keys) {
+            auto u = image(e.first);
+            for (std::size_t pass=0;pass<8;++pass)
+                ++count[pass][(u >> (8 * pass)) & 0xff];
+        }
+        
+        radix_buffer.resize(keys.size());
+        auto *src = &keys;
+        auto *dst = &radix_buffer;
+        
+        for (std::size_t pass=0;pass<8;++pass) {
+            auto shift = 8 * pass;
+            auto &c    = count[pass];
+            if (std::find(c, c + 256, src->size()) != c + 256)
+                continue; // all keys share this digit
+            std::size_t offset = 0;
+            for (auto &slot: c) {
+                auto n = slot;
+                slot = offset;
+                offset += n;
+            }
+            for (auto &e: *src)
+                (*dst)[c[(image(e.first) >> shift) & 0xff]++] = e;
+            std::swap(src, dst);
+        }
+        
+        if (src != &keys)
+            keys.swap(radix_buffer);
+    }
+    
+    //------------------------------------------------------------------------------
+    // Selection Impl.
+    //------------------------------------------------------------------------------
+    
+    template <typename E, typename T>
+    Selection<E,T>::Selection(E* element)
+    {
+        _group_add(element);
+    }
+    
+    template <typename E, typename T>
+    Selection<E,T>::Selection(const selection_type& other):
+    document(other.document),
+    data_guard(other.data_guard),
+    groups(other.groups),
+    elements(other.elements)
+    {
+        if (other.exit_selection || other.enter_selection)
             throw std::runtime_error("cannot copy a selection after a join...");
-        for (auto &g: other.groups) {
-            groups.push_back(std::unique_ptr<group_type>(new group_type(*g.get())));
+    }
+
+    template <typename E, typename T>
+    Selection<E,T>::Selection(selection_type&& other):
+    document(other.document)
+    {
+        data_guard.swap(other.data_guard);
+        groups.swap(other.groups);
+        elements.swap(other.elements);
+        enter_selection.swap(other.enter_selection);
+        exit_selection.swap(other.exit_selection);
+        if (enter_selection)
+            enter_selection->update_selection = this;
+    }
+
+    template <typename E, typename T>
+    auto Selection<E,T>::operator=(const selection_type& other) -> selection_type& {
+        if (this != &other) {
+            selection_type copy(other);
+            *this = std::move(copy);
+        }
+        return *this;
+    }
+    
+    template <typename E, typename T>
+    auto Selection<E,T>::operator=(selection_type&& other) -> selection_type& {
+        if (this != &other) {
+            document   = other.document;
+            data_guard = std::move(other.data_guard);
+            groups.clear();
+            groups.swap(other.groups); // swap keeps the group addresses
+            elements.clear();
+            elements.swap(other.elements);
+            enter_selection = std::move(other.enter_selection);
+            exit_selection  = std::move(other.exit_selection);
+            if (enter_selection)
+                enter_selection->update_selection = this;
+        }
+        return *this;
+    }
+    
+    template <typename E, typename T>
+    auto Selection<E,T>::_group_add(element_value_type parent) -> group_type& {
+        groups.push_back(group_type(parent, elements.size()));
+        return groups.back();
+    }
+
+    template <typename E, typename T>
+    auto Selection<E,T>::_group_add(element_type *parent_node) -> group_type& {
+        groups.push_back(group_type(element_value_type(parent_node), elements.size()));
+        return groups.back();
+    }
+    
+    template <typename E, typename T>
+    void Selection<E,T>::_element_add(E* e, T value) {
+        elements.push_back({e, std::move(value)});
+        ++groups.back().count;
+    }
+    
+    template <typename E, typename T>
+    void Selection<E,T>::_element_add(E* e) {
+        elements.push_back({e});
+        ++groups.back().count;
+    }
+    
+    template <typename E, typename T>
+    auto Selection<E,T>::elements_of(const group_type &g) -> range_type {
+        auto first = elements.data() + g.offset;
+        return { first, first + g.count };
+    }
+    
+    template <typename E, typename T>
+    auto Selection<E,T>::elements_of(const group_type &g) const -> const_range_type {
+        auto first = elements.data() + g.offset;
+        return { first, first + g.count };
+    }
+    
+    template <typename E, typename T>
+    std::size_t Selection<E,T>::size() const {
+        return elements.size();
+    }
+    
+    template <typename E, typename T>
+    bool Selection<E,T>::empty() const {
+        return elements.empty();
+    }
+
+    template <typename E, typename T>
+    auto Selection<E,T>::append(append_function_type append_function) -> selection_type
+    {
+        detail::PhaseScope<E> scope(document, Stats::APPEND, "Selection::append");
+        
+        selection_type result;
+        result.document   = document;
+        result.data_guard = data_guard;
+        result.elements.reserve(elements.size());
+        for (auto &g: groups) {
+            result._group_add(g.parent);
+            for (auto &ev: elements_of(g)) {
+                auto new_element = append_function(ev.element);
+                if (document)
+                    document->_notify_append(ev.element, new_element);
+                result._element_add(new_element, ev.value);
+            }
+        }
+        scope.built(result);
+        return result;
+    }
+    
+    template <typename E, typename T>
+    void Selection<E,T>::_append_to_groups(const std::vector<group_type*> &targets,
+                                           const selection_type &source)
+    {
+        if (source.elements.empty())
+            return;
+        
+        std::size_t k = 0;
+        for (auto &g: groups) {
+            for (;k < targets.size() && targets[k] == &g;++k) {}
+        }
+        if (k != targets.size())
+            throw std::runtime_error("enter groups don't follow the update selection groups");
+        
+        std::vector<element_value_type> merged;
+        merged.reserve(elements.size() + source.elements.size());
+        
+        k = 0;
+        for (auto &g: groups) {
+            auto offset = merged.size();
+            auto current = elements_of(g);
+            merged.insert(merged.end(), std::make_move_iterator(current.begin()), std::make_move_iterator(current.end()));
+            for (;k < targets.size() && targets[k] == &g;++k) {
+                auto added = source.elements_of(source.groups[k]);
+                merged.insert(merged.end(), added.begin(), added.end());
+            }
+            g.offset = offset;
+            g.count  = merged.size() - offset;
+        }
+        elements.swap(merged);
+    }
+    
+    template <typename E, typename T>
+    template <typename U>
+    Selection<E,U> Selection<E,T>::data(const std::vector<U>& data) {
+        return _data_index(std::vector<U>(data)); // the enter selection keeps this copy
+    }
+    
+    template <typename E, typename T>
+    template <typename U>
+    Selection<E,U> Selection<E,T>::data(std::vector<U>&& data) {
+        return _data_index(std::move(data));
+    }
+    
+    template <typename E, typename T>
+    template <typename U>
+    Selection<E,U> Selection<E,T>::_data_index(std::vector<U>&& shared_data) {
+        detail::PhaseScope<E> scope(document, Stats::DATA, "Selection::data");
+        
+        Selection<E,U> result;
+        result.document = document;
+        
+        // just the bare update part here... not enter or exit
+        // match by index
+        
+        // every group is joined against the same list: it can't be moved
+        // from, only into the enter selection
+        auto &data = result._enterSelection_init(std::move(shared_data)).enter_data.front();
+        auto &exit_selection = result._exitSelection_init();
+        
+        for (auto &g: groups) {
+            
+            auto &new_group = result._group_add(g.parent.element);
+            
+            auto group_elements = elements_of(g);
+            
+            auto it_data     = data.begin();
+            auto it_data_end = data.end();
+
+            auto it_ev       = group_elements.begin();
+            auto it_ev_end   = group_elements.end();
+
+            
+            auto index = 0;
+            for (;it_data!= it_data_end && it_ev != it_ev_end ;++it_data,++it_ev) {
+                result._element_add(it_ev->element, *it_data);
+                ++index;
+            }
+            
+            //
+            // this is still wrong
+            //
+            
+            result._enterSelection_add(&new_group,index);
+            
+            if (it_ev != it_ev_end) {
+                exit_selection._group_add(g.parent.element);
+                for (;it_ev != it_ev_end;++it_ev)
+                    exit_selection._element_add(it_ev->element);
+            }
+        }
+        
+        scope.joined(result);
+        return result;
+    }
+
+    
+    template <typename E, typename T>
+    template <typename U, typename K>
+    Selection<E,U> Selection<E,T>::data(const std::vector<U>& data,
+                                        std::function<K(const U&)> data2key,
+                                        std::function<K(const E&)> elem2key)
+    {
+        return _data_keyed(data, data2key, elem2key);
+    }
+    
+    template <typename E, typename T>
+    template <typename U, typename D2K, typename E2K, typename>
+    Selection<E,U> Selection<E,T>::data(const std::vector<U>& data, D2K&& data2key, E2K&& elem2key) {
+        return _data_keyed(data, data2key, elem2key);
+    }
+    
+    template <typename E, typename T>
+    template <typename U, typename D2K, typename E2K>
+    Selection<E,U> Selection<E,T>::data(std::vector<U>&& data, D2K&& data2key, E2K&& elem2key) {
+        return _data_keyed(std::move(data), data2key, elem2key);
+    }
+    
+    template <typename E, typename T>
+    template <typename V, typename D2K, typename E2K, typename U>
+    Selection<E,U> Selection<E,T>::_data_keyed(V&& data, D2K &data2key, E2K &elem2key)
+    {
+        using K                     = typename std::decay<decltype(data2key(std::declval<const U&>()))>::type;
+        using result_selection_type = Selection<E,U>;
+        using scratch_type          = KeyedJoinScratch<K>;
+        
+        detail::PhaseScope<E> scope(document, Stats::DATA, "Selection::data keyed");
+        
+        result_selection_type result;
+        result.document = document;
+        
+        result._enterSelection_init();
+        auto &exit_selection = result._exitSelection_init();
+        
+        // data index is shared by all groups: a datum matched in one
+        // group is no longer available to the next ones
+        std::unique_ptr<scratch_type> local_scratch;
+        auto &scratch = _scratch(local_scratch);
+        scratch.reset(data.size());
+        auto &key2data = scratch.index;
+        
+        for (std::size_t i=0;i<data.size();++i) {
+            auto k = data2key(data[i]);
+            auto h = key2data.hash(k);
+            auto previous = key2data.insert(std::move(k), h, i);
+            if (previous != key2data.npos)
+                scratch.state[previous] = scratch_type::SHADOWED; // last datum with a key wins
+            else
+                ++scratch.available;
+            scratch.state[i] = scratch_type::AVAILABLE;
+        }
+        
+        for (auto &g: groups) {
+            
+            auto &new_group = result._group_add(g.parent.element);
+
+            bool has_exit_group = false;
+            
+            for (auto &e: elements_of(g)) {
+                auto k = elem2key(*e.element);
+                
+                auto it = key2data.find(k, key2data.hash(k));
+                
+                if (!it || *it == key2data.npos) {
+                    if (!has_exit_group) {
+                        exit_selection._group_add(g.parent.element);
+                        has_exit_group = true;
+                    }
+                    exit_selection._element_add(e.element);
+                }
+                else {
+                    result._element_add(e.element, detail::forward_element<V>(data[*it])); // consumed once
+                    scratch.state[*it] = scratch_type::CONSUMED;
+                    --scratch.available;
+                    *it = key2data.npos;
+                }
+            }
+            
+            if (scratch.available > 0) {
+                // available data enter every group: only the last one can take them
+                bool last_group = &g == &groups.back();
+                std::vector<U> enter_data_for_g;
+                enter_data_for_g.reserve(scratch.available);
+                for (std::size_t i=0;i<data.size();++i) {
+                    if (scratch.state[i] != scratch_type::AVAILABLE)
+                        continue;
+                    if (last_group)
+                        enter_data_for_g.push_back(detail::forward_element<V>(data[i]));
+                    else
+                        enter_data_for_g.push_back(data[i]);
+                }
+                result._enterSelection_add(&new_group, 0, std::move(enter_data_for_g));
+            }
+        }
+        
+        scope.hashed(key2data);
+        scope.joined(result);
+        return result;
+    }
+
+    
+    
+    
+    
+    template <typename E, typename T>
+    template <typename U>
+    Selection<E,U> Selection<E,T>::data(std::function<std::vector<U>(const T&)> mapping) {
+        return _data_mapping<U>(mapping);
+    }
+    
+    template <typename E, typename T>
+    template <typename F, typename U, typename>
+    Selection<E,U> Selection<E,T>::data(F&& mapping) {
+        return _data_mapping<U>(mapping);
+    }
+    
+    template <typename E, typename T>
+    template <typename U, typename F>
+    Selection<E,U> Selection<E,T>::_data_mapping(F &mapping) {
+        detail::PhaseScope<E> scope(document, Stats::DATA, "Selection::data mapping");
+        
+        Selection<E,U> result;
+        result.document = document;
+        
+        // just the bare update part here... not enter or exit
+        // match by index
+
+        result._enterSelection_init();
+
+        auto &exit_selection = result._exitSelection_init();
+        
+        for (auto &g: groups) {
+            
+            detail::TraceScope group_scope("group", (std::int64_t) result.groups.size()); // index of g
+            
+            auto data = mapping(g.parent.value);
+            
+            auto &new_group = result._group_add(g.parent.element);
+            
+            auto group_elements = elements_of(g);
+            
+            auto it_data     = data.begin();
+            auto it_data_end = data.end();
+            
+            auto it_ev       = group_elements.begin();
+            auto it_ev_end   = group_elements.end();
+            
+            auto index = 0;
+            // data is ours: the update part is moved out of it and the
+            // rest (enter reads data[index...]) moved into the enter selection
+            for (;it_data!= it_data_end && it_ev != it_ev_end ;++it_data,++it_ev) {
+                result._element_add(it_ev->element, std::move(*it_data));
+                ++index;
+            }
+            
+            //
+            // this is still wrong
+            //
+            
+            result._enterSelection_add(&new_group,index,std::move(data));
+            
+            if (it_ev != it_ev_end) {
+                exit_selection._group_add(g.parent.element);
+                for (;it_ev != it_ev_end;++it_ev)
+                    exit_selection._element_add(it_ev->element);
+            }
+        }
+        
+        scope.joined(result);
+        return result;
+    }
+    
+    
+    
+    
+    
+    template <typename E, typename T>
+    template <typename U, typename K>
+    Selection<E,U> Selection<E,T>::data(std::function<std::vector<U>(const T&)> mapping,
+                                        std::function<K(const U&)> data2key,
+                                        std::function<K(const E&)> elem2key)
+    {
+        return _data_mapping_keyed<U>(mapping, data2key, elem2key);
+    }
+    
+    template <typename E, typename T>
+    template <typename F, typename D2K, typename E2K, typename U, typename>
+    Selection<E,U> Selection<E,T>::data(F&& mapping, D2K&& data2key, E2K&& elem2key) {
+        return _data_mapping_keyed<U>(mapping, data2key, elem2key);
+    }
+    
+    template <typename E, typename T>
+    template <typename U, typename F, typename D2K, typename E2K>
+    Selection<E,U> Selection<E,T>::_data_mapping_keyed(F &mapping, D2K &data2key, E2K &elem2key)
+    {
+        using K                     = typename std::decay<decltype(data2key(std::declval<const U&>()))>::type;
+        using result_selection_type = Selection<E,U>;
+        using scratch_type          = KeyedJoinScratch<K>;
+        
+        detail::PhaseScope<E> scope(document, Stats::DATA, "Selection::data mapping keyed");
+        
+        result_selection_type result;
+        result.document = document;
+        
+        result._enterSelection_init();
+        
+        auto &exit_selection = result._exitSelection_init();
+        
+        // one index reused (capacity included) by every group
+        std::unique_ptr<scratch_type> local_scratch;
+        auto &scratch = _scratch(local_scratch);
+        auto &key2data = scratch.index;
+        
+        for (auto &g: groups) {
+            
+            detail::TraceScope group_scope("group", (std::int64_t) result.groups.size()); // index of g
+            
+            auto data = mapping(g.parent.value);
+            
+            scratch.reset(data.size());
+            for (std::size_t i=0;i<data.size();++i) {
+                auto k = data2key(data[i]);
+                auto h = key2data.hash(k);
+                auto previous = key2data.insert(std::move(k), h, i);
+                if (previous != key2data.npos)
+                    scratch.state[previous] = scratch_type::SHADOWED; // last datum with a key wins
+                else
+                    ++scratch.available;
+                scratch.state[i] = scratch_type::AVAILABLE;
+            }
+            
+            auto &new_group = result._group_add(g.parent.element);
+            
+            bool has_exit_group = false;
+            
+            for (auto &e: elements_of(g)) {
+                auto k = elem2key(*e.element);
+                
+                auto it = key2data.find(k, key2data.hash(k));
+                
+                if (!it || *it == key2data.npos) {
+                    if (!has_exit_group) {
+                        exit_selection._group_add(g.parent.element);
+                        has_exit_group = true;
+                    }
+                    exit_selection._element_add(e.element);
+                }
+                else {
+                    result._element_add(e.element, std::move(data[*it]));
+                    scratch.state[*it] = scratch_type::CONSUMED;
+                    --scratch.available;
+                    *it = key2data.npos;
+                }
+            }
+            
+            if (scratch.available > 0) {
+                std::vector<U> enter_data_for_g;
+                enter_data_for_g.reserve(scratch.available);
+                for (std::size_t i=0;i<data.size();++i) {
+                    if (scratch.state[i] == scratch_type::AVAILABLE)
+                        enter_data_for_g.push_back(std::move(data[i]));
+                }
+                result._enterSelection_add(&new_group, 0, std::move(enter_data_for_g));
+            }
+        }
+        
+        scope.hashed(key2data);
+        scope.joined(result);
+        return result;
+
+    }
+    
+    template <typename E, typename T>
+    template <typename F, typename U>
+    Selection<E,U> Selection<E,T>::data(const execution::Parallel &policy, F&& mapping) {
+        using chunk_type = JoinChunk<E,U,int>;
+        
+        detail::PhaseScope<E> scope(document, Stats::DATA, "Selection::data mapping parallel");
+        
+        // by index, as _data_mapping
+        auto result = _data_mapping_parallel<U,int>(policy, mapping,
+            [this](chunk_type &chunk, const group_type &g, std::vector<U> &data, typename chunk_type::GroupJoin &out) {
+                auto group_elements = elements_of(g);
+                auto n = std::min(data.size(), group_elements.size());
+                for (std::size_t i=0;i<n;++i)
+                    chunk.update.emplace_back(group_elements[i].element, std::move(data[i]));
+                for (auto i=n;i<group_elements.size();++i)
+                    chunk.exit.push_back(group_elements[i].element);
+                out.enter_index = (int) n;
+                out.enter       = std::move(data);
+            }, scope);
+        
+        scope.joined(result);
+        return result;
+    }
+    
+    template <typename E, typename T>
+    template <typename F, typename D2K, typename E2K, typename U>
+    Selection<E,U> Selection<E,T>::data(const execution::Parallel &policy, F&& mapping, D2K&& data2key, E2K&& elem2key) {
+        using K            = typename std::decay<decltype(data2key(std::declval<const U&>()))>::type;
+        using scratch_type = KeyedJoinScratch<K>;
+        using chunk_type   = JoinChunk<E,U,scratch_type>;
+        
+        detail::PhaseScope<E> scope(document, Stats::DATA, "Selection::data mapping keyed parallel");
+        
+        // by key, as _data_mapping_keyed, with one index per task
+        auto result = _data_mapping_parallel<U,scratch_type>(policy, mapping,
+            [&](chunk_type &chunk, const group_type &g, std::vector<U> &data, typename chunk_type::GroupJoin &out) {
+                auto &scratch  = chunk.scratch;
+                auto &key2data = scratch.index;
+                
+                scratch.reset(data.size());
+                for (std::size_t i=0;i<data.size();++i) {
+                    auto k = data2key(data[i]);
+                    auto h = key2data.hash(k);
+                    auto previous = key2data.insert(std::move(k), h, i);
+                    if (previous != key2data.npos)
+                        scratch.state[previous] = scratch_type::SHADOWED; // last datum with a key wins
+                    else
+                        ++scratch.available;
+                    scratch.state[i] = scratch_type::AVAILABLE;
+                }
+                
+                for (auto &e: elements_of(g)) {
+                    auto k = elem2key(*e.element);
+                    auto it = key2data.find(k, key2data.hash(k));
+                    if (!it || *it == key2data.npos) {
+                        chunk.exit.push_back(e.element);
+                    }
+                    else {
+                        chunk.update.emplace_back(e.element, std::move(data[*it]));
+                        scratch.state[*it] = scratch_type::CONSUMED;
+                        --scratch.available;
+                        *it = key2data.npos;
+                    }
+                }
+                
+                if (scratch.available > 0) {
+                    out.enter_index = 0;
+                    out.enter.reserve(scratch.available);
+                    for (std::size_t i=0;i<data.size();++i) {
+                        if (scratch.state[i] == scratch_type::AVAILABLE)
+                            out.enter.push_back(std::move(data[i]));
+                    }
+                }
+            }, scope);
+        
+        scope.joined(result);
+        return result;
+    }
+    
+    template <typename E, typename T>
+    template <typename U, typename S, typename F, typename J>
+    Selection<E,U> Selection<E,T>::_data_mapping_parallel(const execution::Parallel &policy, F &mapping, J &&join,
+                                                          detail::PhaseScope<E> &scope)
+    {
+        using chunk_type = JoinChunk<E,U,S>;
+        
+        Selection<E,U> result;
+        result.document = document;
+        
+        result._enterSelection_init();
+        auto &exit_selection = result._exitSelection_init();
+        if (groups.empty())
+            return result;
+        
+        // policy.grain counts elements: tasks take whole groups
+        auto per_group = std::max<std::size_t>(1, elements.size() / groups.size());
+        auto grain     = std::max<std::size_t>(1, policy.grain / per_group);
+        std::vector<chunk_type> chunks((groups.size() + grain - 1) / grain);
+        
+        _thread_pool(policy).parallel_for(groups.size(), grain, [&](std::size_t begin, std::size_t end) {
+            auto &chunk = chunks[begin / grain];
+            chunk.groups.reserve(end - begin);
+            for (auto k=begin;k<end;++k) {
+                detail::TraceScope group_scope("group", (std::int64_t) k);
+                auto &g = groups[k];
+                std::vector<U> data = mapping(g.parent.value);
+                chunk.groups.emplace_back();
+                auto &out = chunk.groups.back();
+                out.group = k;
+                join(chunk, g, data, out);
+                out.update_end = chunk.update.size();
+                out.exit_end   = chunk.exit.size();
+            }
+        });
+        
+        // the chunks hold consecutive groups: merge them in order
+        std::size_t total = 0;
+        for (auto &chunk: chunks)
+            total += chunk.update.size();
+        result.elements.reserve(total);
+        
+        for (auto &chunk: chunks) {
+            std::size_t u = 0, x = 0;
+            for (auto &out: chunk.groups) {
+                auto parent = groups[out.group].parent.element;
+                auto &new_group = result._group_add(parent);
+                for (;u<out.update_end;++u)
+                    result._element_add(chunk.update[u].element, std::move(chunk.update[u].value));
+                if (out.enter_index >= 0)
+                    result._enterSelection_add(&new_group, out.enter_index, std::move(out.enter));
+                if (x < out.exit_end) {
+                    exit_selection._group_add(parent);
+                    for (;x<out.exit_end;++x)
+                        exit_selection._element_add(chunk.exit[x]);
+                }
+            }
+            detail::take_hashed(scope, chunk.scratch);
+        }
+        return result;
+    }
+
+    
+    
+    
+    
+    
+    
+    
+    
+    
+    
+    
+    
+    
+    
+    
+    
+    
+    
+    
+    
+    template <typename E, typename T>
+    template <typename U>
+    Selection<E,DataRef<U>> Selection<E,T>::data(const DataSpan<U>& span) {
+        auto result = data(span.refs);
+        result.data_guard = span.guard;
+        return result;
+    }
+    
+    template <typename E, typename T>
+    template <typename U, typename D2K, typename E2K>
+    Selection<E,DataRef<U>> Selection<E,T>::data(const DataSpan<U>& span, D2K&& data2key, E2K&& elem2key) {
+        auto ref2key = [&data2key](const DataRef<U> &d) { return data2key(d.get()); };
+        auto result = _data_keyed(span.refs, ref2key, elem2key);
+        result.data_guard = span.guard;
+        return result;
+    }
+    
+    template <typename E, typename T>
+    template <typename U, typename D2K, typename E2K>
+    Selection<E,DataRef<U>> Selection<E,T>::data_sorted(const DataSpan<U>& span, D2K&& data2key, E2K&& elem2key) {
+        auto ref2key = [&data2key](const DataRef<U> &d) { return data2key(d.get()); };
+        auto result = _data_sorted(span.refs, ref2key, elem2key);
+        result.data_guard = span.guard;
+        return result;
+    }
+    
+    template <typename E, typename T>
+    template <typename V, typename U, typename K, typename E2K>
+    void Selection<E,T>::_sorted_join_group(const group_type &g,
+                                            V&& data,
+                                            SortedJoinScratch<K> &scratch,
+                                            E2K &elem2key,
+                                            Selection<E,U> &result)
+    {
+        using scratch_type = SortedJoinScratch<K>;
+        
+        auto &data_keys    = scratch.data_keys;    // sorted by the caller
+        auto &element_keys = scratch.element_keys;
+        
+        auto group_elements = elements_of(g);
+        
+        element_keys.clear();
+        element_keys.reserve(group_elements.size());
+        for (std::size_t j=0;j<group_elements.size();++j) {
+            element_keys.push_back({elem2key(*group_elements[j].element), (std::uint32_t) j});
+        }
+        scratch.sort(element_keys);
+        
+        scratch.match.assign(data.size(), scratch_type::none);
+        scratch.matched.assign(group_elements.size(), 0);
+        
+        // one linear merge of the two sorted key lists
+        auto it_d = data_keys.begin(),    it_d_end = data_keys.end();
+        auto it_e = element_keys.begin(), it_e_end = element_keys.end();
+        while (it_d != it_d_end && it_e != it_e_end) {
+            if (it_d->first < it_e->first) {
+                ++it_d;
+            }
+            else if (it_e->first < it_d->first) {
+                ++it_e;
+            }
+            else {
+                scratch.match[it_d->second]   = it_e->second;
+                scratch.matched[it_e->second] = 1;
+                ++it_d;
+                ++it_e;
+            }
+        }
+        
+        auto &new_group = result._group_add(g.parent.element);
+        
+        std::size_t num_enter = 0;
+        for (std::size_t i=0;i<data.size();++i) {
+            if (scratch.match[i] != scratch_type::none)
+                result._element_add(group_elements[scratch.match[i]].element, detail::forward_element<V>(data[i]));
+            else
+                ++num_enter;
+        }
+        
+        if (num_enter > 0) {
+            std::vector<U> enter_data_for_g;
+            enter_data_for_g.reserve(num_enter);
+            for (std::size_t i=0;i<data.size();++i) {
+                if (scratch.match[i] == scratch_type::none)
+                    enter_data_for_g.push_back(detail::forward_element<V>(data[i]));
+            }
+            result._enterSelection_add(&new_group, 0, std::move(enter_data_for_g));
+        }
+        
+        if (new_group.count < group_elements.size()) {
+            auto &exit_selection = *result.exit_selection;
+            exit_selection._group_add(g.parent.element);
+            for (std::size_t j=0;j<group_elements.size();++j) {
+                if (!scratch.matched[j])
+                    exit_selection._element_add(group_elements[j].element);
+            }
+        }
+    }
+    
+    template <typename E, typename T>
+    template <typename U, typename K>
+    Selection<E,U> Selection<E,T>::data_sorted(const std::vector<U>& data,
+                                               std::function<K(const U&)> data2key,
+                                               std::function<K(const E&)> elem2key)
+    {
+        return _data_sorted(data, data2key, elem2key);
+    }
+    
+    template <typename E, typename T>
+    template <typename U, typename D2K, typename E2K, typename>
+    Selection<E,U> Selection<E,T>::data_sorted(const std::vector<U>& data, D2K&& data2key, E2K&& elem2key) {
+        return _data_sorted(data, data2key, elem2key);
+    }
+    
+    template <typename E, typename T>
+    template <typename U, typename D2K, typename E2K>
+    Selection<E,U> Selection<E,T>::data_sorted(std::vector<U>&& data, D2K&& data2key, E2K&& elem2key) {
+        return _data_sorted(std::move(data), data2key, elem2key);
+    }
+    
+    template <typename E, typename T>
+    template <typename V, typename D2K, typename E2K, typename U>
+    Selection<E,U> Selection<E,T>::_data_sorted(V&& data, D2K &data2key, E2K &elem2key)
+    {
+        using K            = typename std::decay<decltype(data2key(std::declval<const U&>()))>::type;
+        using scratch_type = SortedJoinScratch<K>;
+        
+        detail::PhaseScope<E> scope(document, Stats::DATA, "Selection::data_sorted");
+        
+        Selection<E,U> result;
+        result.document = document;
+        
+        result._enterSelection_init();
+        result._exitSelection_init();
+        
+        std::unique_ptr<scratch_type> local_scratch;
+        auto &scratch = _scratch(local_scratch);
+        
+        scratch.data_keys.clear();
+        scratch.data_keys.reserve(data.size());
+        for (std::size_t i=0;i<data.size();++i) {
+            scratch.data_keys.push_back({data2key(data[i]), (std::uint32_t) i});
+        }
+        scratch.sort(scratch.data_keys);
+        
+        // every group is joined against all the data: only the last
+        // one may move from them
+        for (auto &g: groups) {
+            if (&g == &groups.back())
+                _sorted_join_group(g, std::forward<V>(data), scratch, elem2key, result);
+            else
+                _sorted_join_group(g, static_cast<const std::vector<U>&>(data), scratch, elem2key, result);
+        }
+        
+        scope.joined(result);
+        return result;
+    }
+    
+    template <typename E, typename T>
+    template <typename U, typename K>
+    Selection<E,U> Selection<E,T>::data_sorted(std::function<std::vector<U>(const T&)> mapping,
+                                               std::function<K(const U&)> data2key,
+                                               std::function<K(const E&)> elem2key)
+    {
+        return _data_sorted_mapping<U>(mapping, data2key, elem2key);
+    }
+    
+    template <typename E, typename T>
+    template <typename F, typename D2K, typename E2K, typename U, typename>
+    Selection<E,U> Selection<E,T>::data_sorted(F&& mapping, D2K&& data2key, E2K&& elem2key) {
+        return _data_sorted_mapping<U>(mapping, data2key, elem2key);
+    }
+    
+    template <typename E, typename T>
+    template <typename U, typename F, typename D2K, typename E2K>
+    Selection<E,U> Selection<E,T>::_data_sorted_mapping(F &mapping, D2K &data2key, E2K &elem2key)
+    {
+        using K            = typename std::decay<decltype(data2key(std::declval<const U&>()))>::type;
+        using scratch_type = SortedJoinScratch<K>;
+        
+        detail::PhaseScope<E> scope(document, Stats::DATA, "Selection::data_sorted mapping");
+        
+        Selection<E,U> result;
+        result.document = document;
+        
+        result._enterSelection_init();
+        result._exitSelection_init();
+        
+        std::unique_ptr<scratch_type> local_scratch;
+        auto &scratch = _scratch(local_scratch);
+        
+        for (auto &g: groups) {
+            
+            detail::TraceScope group_scope("group", (std::int64_t) result.groups.size()); // index of g
+            
+            auto data = mapping(g.parent.value);
+            
+            scratch.data_keys.clear();
+            scratch.data_keys.reserve(data.size());
+            for (std::size_t i=0;i<data.size();++i) {
+                scratch.data_keys.push_back({data2key(data[i]), (std::uint32_t) i});
+            }
+            scratch.sort(scratch.data_keys);
+            
+            _sorted_join_group(g, std::move(data), scratch, elem2key, result);
+        }
+        
+        scope.joined(result);
+        return result;
+    }
+    
+    template<typename E, typename T>
+    auto Selection<E,T>::_enterSelection_init(const std::vector<T>& extra_data) -> enter_selection_type& {
+        enter_selection.reset(new enter_selection_type(this,extra_data));
+        return *enter_selection.get();
+    }
+    
+    template<typename E, typename T>
+    auto Selection<E,T>::_enterSelection_init(std::vector<T>&& extra_data) -> enter_selection_type& {
+        enter_selection.reset(new enter_selection_type(this,std::move(extra_data)));
+        return *enter_selection.get();
+    }
+    
+    template<typename E, typename T>
+    void Selection<E,T>::_enterSelection_add(group_type *main_selection_parent_children, int index) {
+        if (!enter_selection)
+            throw std::runtime_error("ooops");
+        enter_selection->_add(main_selection_parent_children,index);
+    }
+
+    template<typename E, typename T>
+    auto Selection<E,T>::_enterSelection_init() -> enter_selection_type& {
+        enter_selection.reset(new enter_selection_type(this));
+        return *enter_selection.get();
+    }
+    
+    template<typename E, typename T>
+    void Selection<E,T>::_enterSelection_add(group_type *main_selection_parent_children, int index, const std::vector<T>& group_data) {
+        if (!enter_selection)
+            throw std::runtime_error("ooops");
+        enter_selection->_add(main_selection_parent_children,index,group_data);
+    }
+    
+    template<typename E, typename T>
+    void Selection<E,T>::_enterSelection_add(group_type *main_selection_parent_children, int index, std::vector<T>&& group_data) {
+        if (!enter_selection)
+            throw std::runtime_error("ooops");
+        enter_selection->_add(main_selection_parent_children,index,std::move(group_data));
+    }
+
+    template<typename E, typename T>
+    auto Selection<E,T>::_exitSelection_init() -> exit_selection_type& {
+        exit_selection.reset(new exit_selection_type());
+        exit_selection->document = document;
+        return *exit_selection.get();
+    }
+    
+    template<typename E, typename T>
+    template<typename S>
+    auto Selection<E,T>::_scratch(std::unique_ptr<S> &local) -> S& {
+        if (document)
+            return document->template scratch<S>();
+        local.reset(new S());
+        return *local.get();
+    }
+    
+    template<typename E, typename T>
+    auto Selection<E,T>::enter() -> enter_selection_type& {
+        return *enter_selection.get();
+    }
+    
+    template<typename E, typename T>
+    auto Selection<E,T>::exit() -> exit_selection_type& {
+        return *exit_selection.get();
+    }
+    
+    template<typename E, typename T>
+    template<typename I>
+    auto Selection<E,T>::selectAll(predicate_type predicate, std::function<I(E*)> gen_iterator) -> selection_type {
+        return _selectAll(predicate, gen_iterator);
+    }
+    
+    template<typename E, typename T>
+    template<typename P, typename G, typename>
+    auto Selection<E,T>::selectAll(P&& predicate, G&& gen_iterator) -> selection_type {
+        return _selectAll(predicate, gen_iterator);
+    }
+    
+    template<typename E, typename T>
+    template<typename P, typename G>
+    auto Selection<E,T>::_selectAll(P &predicate, G &gen_iterator) -> selection_type {
+        detail::PhaseScope<E> scope(document, Stats::SELECT, "Selection::selectAll");
+        
+        selection_type result;
+        result.document   = document;
+        result.data_guard = data_guard; // group parents keep their values
+        if (elements.empty())
+            return result;
+        
+        // one iterator for all groups if restartable (see detail::restart_iterator)
+        std::size_t visited = 0;
+        auto it = gen_iterator(elements.front().element);
+        for (auto &ev: elements) {
+            if (&ev != &elements.front())
+                detail::restart_iterator(it, gen_iterator, ev.element, RestartableIterator<decltype(it)>());
+            result._group_add(ev);
+            while (auto e = it.next()) {
+                ++visited;
+                if (predicate(e)) {
+                    result._element_add(e);
+                }
+            }
+        }
+        scope.visited(visited, visited);
+        scope.built(result);
+        return result;
+    }
+    
+    template<typename E, typename T>
+    template<typename V>
+    auto Selection<E,T>::selectAll(V&& visitor) -> selection_type {
+        detail::PhaseScope<E> scope(document, Stats::SELECT, "Selection::selectAll visitor");
+        
+        selection_type result;
+        result.document   = document;
+        result.data_guard = data_guard;
+        std::unique_ptr<TraversalScratch<E>> local_scratch;
+        auto &stack = _scratch(local_scratch).stack;
+        for (auto &ev: elements) {
+            result._group_add(ev);
+            result._visit(ev.element, false, visitor, stack, scope);
+        }
+        scope.built(result);
+        return result;
+    }
+    
+    template<typename E, typename T>
+    template<typename V>
+    void Selection<E,T>::_visit(E* root, bool include_root, V &visitor, std::vector<E*> &stack, detail::PhaseScope<E> &scope) {
+        // pre-order: children are pushed in reverse
+        auto push_children = [&stack](E* e) {
+            auto mark = stack.size();
+            TreeTraits<E>::for_each_child(e, [&stack](E* child) { stack.push_back(child); });
+            std::reverse(stack.begin() + mark, stack.end());
+        };
+        
+        stack.clear();
+        if (include_root)
+            stack.push_back(root);
+        else
+            push_children(root);
+        
+        std::size_t visited = 0;
+        while (!stack.empty()) {
+            auto e = stack.back();
+            stack.pop_back();
+            ++visited;
+            visit::flags f = visitor(e);
+            if (f & visit::match)
+                _element_add(e);
+            if (f & visit::stop)
+                break;
+            if (!(f & visit::prune))
+                push_children(e);
         }
+        stack.clear();
+        scope.visited(visited, visited);
     }
-
+    
+    template<typename E, typename T>
+    auto Selection<E,T>::selectChildren() -> selection_type {
+        return selectChildren([](const E*) { return true; });
+    }
+    
+    template<typename E, typename T>
+    template<typename P>
+    auto Selection<E,T>::selectChildren(P&& predicate) -> selection_type {
+        detail::PhaseScope<E> scope(document, Stats::SELECT, "Selection::selectChildren");
+        
+        selection_type result;
+        result.document   = document;
+        result.data_guard = data_guard;
+        std::size_t visited = 0;
+        for (auto &ev: elements) {
+            result._group_add(ev);
+            TreeTraits<E>::for_each_child(ev.element, [&](E* child) {
+                ++visited;
+                if (predicate(child))
+                    result._element_add(child);
+            });
+        }
+        scope.visited(visited, visited);
+        scope.built(result);
+        return result;
+    }
+    
+    template<typename E, typename T>
+    template<typename P, typename G>
+    auto Selection<E,T>::selectAll(const execution::Parallel &policy, P&& predicate, G&& gen_iterator) -> selection_type {
+        detail::PhaseScope<E> scope(document, Stats::SELECT, "Selection::selectAll parallel");
+        
+        selection_type result;
+        result.document   = document;
+        result.data_guard = data_guard;
+        
+        std::vector<E*> roots;
+        roots.reserve(elements.size());
+        for (auto &ev: elements) {
+            roots.push_back(ev.element);
+            result._group_add(ev);
+        }
+        _selectAll_parallel(_thread_pool(policy), roots, predicate, gen_iterator, result, scope);
+        scope.built(result);
+        return result;
+    }
+    
+    template<typename E, typename T>
+    template<typename P, typename G>
+    void Selection<E,T>::_selectAll_parallel(ThreadPool &pool,
+                                             const std::vector<E*> &roots,
+                                             P &predicate,
+                                             G &gen_iterator,
+                                             selection_type &result,
+                                             detail::PhaseScope<E> &scope)
+    {
+        using iterator_type = typename std::decay<decltype(gen_iterator(roots.front()))>::type;
+        
+        // the pre-order of a subtree is its root followed by the pre-order
+        // of each child subtree: split subtrees this way until there are
+        // enough pieces to keep every thread busy. a root is split only if
+        // its iterator walks that whole pre-order (SplittableIterator);
+        // the pieces below it are walked the same way by TreeIterators
+        enum Kind { NODE, GENERATED, WHOLE }; // node only, gen_iterator, TreeIterator
+        struct Piece {
+            E*          node;
+            std::size_t root;
+            Kind        kind;
+        };
+        
+        std::vector<Piece> pieces;
+        pieces.reserve(roots.size());
+        for (std::size_t r=0;r<roots.size();++r)
+            pieces.push_back({roots[r], r, GENERATED});
+        
+        auto target = 8 * pool.concurrency();
+        for (int round=0;round<4 && pieces.size() < target;++round) {
+            std::vector<Piece> next;
+            bool split = false;
+            for (auto &piece: pieces) {
+                auto splittable = piece.kind == WHOLE ||
+                    (piece.kind == GENERATED && SplittableIterator<iterator_type>::whole(gen_iterator(piece.node)));
+                if (splittable && TreeTraits<E>::has_children(piece.node)) {
+                    next.push_back({piece.node, piece.root, NODE});
+                    TreeTraits<E>::for_each_child(piece.node, [&](E* child) {
+                        next.push_back({child, piece.root, WHOLE});
+                    });
+                    split = true;
+                }
+                else {
+                    next.push_back(piece);
+                }
+            }
+            if (!split)
+                break;
+            pieces.swap(next);
+        }
+        
+        // contiguous runs of pieces per chunk keep the output in order
+        auto num_chunks = std::min<std::size_t>(pieces.size(), 4 * pool.concurrency());
+        if (num_chunks == 0)
+            return;
+        auto grain = (pieces.size() + num_chunks - 1) / num_chunks;
+        std::vector<std::vector<std::pair<std::size_t, E*>>> matches((pieces.size() + grain - 1) / grain);
+        std::vector<std::size_t> visited(Stats::enabled ? matches.size() : 0); // per chunk
+        
+        pool.parallel_for(pieces.size(), grain, [&](std::size_t begin, std::size_t end) {
+            detail::TraceScope chunk_scope("selectAll chunk", (std::int64_t) (begin / grain));
+            auto &output = matches[begin / grain];
+            std::size_t count = 0;
+            std::unique_ptr<iterator_type> it; // one of each per chunk
+            TreeIterator<E>                whole_it;
+            auto walk = [&](const Piece &piece, E* e) {
+                ++count;
+                if (predicate(e))
+                    output.push_back({piece.root, e});
+            };
+            for (auto i=begin;i<end;++i) {
+                auto &piece = pieces[i];
+                if (piece.kind == NODE) {
+                    walk(piece, piece.node);
+                }
+                else if (piece.kind == WHOLE) {
+                    whole_it.reset(piece.node);
+                    while (auto e = whole_it.next())
+                        walk(piece, e);
+                }
+                else {
+                    if (it)
+                        detail::restart_iterator(*it, gen_iterator, piece.node, RestartableIterator<iterator_type>());
+                    else
+                        it.reset(new iterator_type(gen_iterator(piece.node)));
+                    while (auto e = it->next())
+                        walk(piece, e);
+                }
+            }
+            if (Stats::enabled)
+                visited[begin / grain] = count;
+        });
+        for (auto count: visited)
+            scope.visited(count, count);
+        
+        // matches come out in root order: fill the groups one after the other
+        std::size_t total = 0;
+        for (auto &output: matches)
+            total += output.size();
+        result.elements.reserve(result.elements.size() + total);
+        
+        auto first_group = result.groups.size() - roots.size();
+        std::size_t r = 0;
+        for (auto &output: matches) {
+            for (auto &m: output) {
+                for (;r < m.first;++r)
+                    result.groups[first_group + r + 1].offset = result.elements.size();
+                result.elements.push_back({m.second});
+                ++result.groups[first_group + r].count;
+            }
+        }
+        for (;r + 1 < roots.size();++r)
+            result.groups[first_group + r + 1].offset = result.elements.size();
+    }
+    
     template <typename E, typename T>
-    Selection<E,T>::Selection(selection_type&& other) {
-        groups.swap(other.groups);
-        enter_selection.swap(other.enter_selection);
-        exit_selection.swap(other.exit_selection);
+    auto Selection<E,T>::remove(remove_from_document_function_type remove_from_document_function) -> selection_type& {
+        _remove(remove_from_document_function);
+        return *this;
     }
-
+    
     template <typename E, typename T>
-    auto Selection<E,T>::operator=(const selection_type& other) -> selection_type& {
-        *this = other;
+    template <typename F, typename>
+    auto Selection<E,T>::remove(F&& remove_from_document_function) -> selection_type& {
+        _remove(remove_from_document_function);
         return *this;
     }
     
     template <typename E, typename T>
-    auto Selection<E,T>::operator=(selection_type&& other) -> selection_type& {
-        *this = std::move(other);
+    template <typename F>
+    void Selection<E,T>::_remove(F &remove_from_document_function) {
+        detail::PhaseScope<E> scope(document, Stats::REMOVE, "Selection::remove");
+        for (auto &ev: elements) {
+            // std::cerr << "removing element... " << ev.element << std::endl;
+            if (document)
+                document->_notify_remove(ev.element);
+            remove_from_document_function(ev.element);
+        }
+        elements.clear();
+        for (auto &g: groups) {
+            g.offset = 0;
+            g.count  = 0;
+        }
+    }
+    
+    template<typename E, typename T>
+    auto Selection<E,T>::call(call_type f) -> selection_type& {
+        _call(f);
         return *this;
     }
     
-//    template <typename E, typename T>
-//    auto Selection<E,T>::_group_add(E *parent_node, E* new_child) -> group_type& {
-//        groups.push_back(std::unique_ptr<group_type>(new group_type {parent_node, new_child}));
-//        return *groups.back().get();
-//    }
+    template<typename E, typename T>
+    template<typename F, typename>
+    auto Selection<E,T>::call(F&& f) -> selection_type& {
+        _call(f);
+        return *this;
+    }
     
-    template <typename E, typename T>
-    auto Selection<E,T>::_group_add(element_value_type parent) -> group_type& {
-        groups.push_back(std::unique_ptr<group_type>(new group_type {parent}));
-        return *groups.back().get();
+    template<typename E, typename T>
+    template<typename F>
+    void Selection<E,T>::_call(F &f) {
+        _check_data_guard();
+        detail::PhaseScope<E> scope(document, Stats::CALL, "Selection::call");
+        for (auto &ev: elements) {
+            f(ev.element, ev.value);
+        }
+        _notify_update();
     }
-
-    template <typename E, typename T>
-    auto Selection<E,T>::_group_add(element_type *parent_node) -> group_type& {
-        groups.push_back(std::unique_ptr<group_type>(new group_type {parent_node}));
-        return *groups.back().get();
+    
+    template<typename E, typename T>
+    void Selection<E,T>::_notify_update() {
+        if (document && document->_observed()) {
+            for (auto &ev: elements)
+                document->_notify_update(ev.element);
+        }
     }
-
-    template <typename E, typename T>
-    auto Selection<E,T>::append(append_function_type append_function) -> selection_type
-    {
-        selection_type result;
+    
+    template<typename E, typename T>
+    template<typename F>
+    auto Selection<E,T>::call_parallel(F&& f) -> selection_type& {
+        _call_parallel(execution::par, f);
+        return *this;
+    }
+    
+    template<typename E, typename T>
+    template<typename F>
+    auto Selection<E,T>::call(const execution::Parallel &policy, F&& f) -> selection_type& {
+        _call_parallel(policy, f);
+        return *this;
+    }
+    
+    template<typename E, typename T>
+    template<typename F>
+    auto Selection<E,T>::call(execution::Sequential, F&& f) -> selection_type& {
+        _call(f);
+        return *this;
+    }
+    
+    template<typename E, typename T>
+    template<typename F>
+    void Selection<E,T>::_call_parallel(const execution::Parallel &policy, F &f) {
+        _check_data_guard();
+        detail::PhaseScope<E> scope(document, Stats::CALL, "Selection::call_parallel");
+        _thread_pool(policy).parallel_for(elements.size(), policy.grain, [&](std::size_t begin, std::size_t end) {
+            detail::TraceScope chunk_scope("call chunk", (std::int64_t) begin);
+            for (auto i=begin;i<end;++i) {
+                f(elements[i].element, elements[i].value);
+            }
+        });
+        _notify_update(); // observers are not thread safe
+    }
+    
+    template<typename E, typename T>
+    template<typename K, typename P>
+    auto Selection<E,T>::attr(const K& key, P&& projection) -> selection_type& {
+        return attr(key, projection, scale::Identity());
+    }
+    
+    template<typename E, typename T>
+    template<typename K, typename P, typename S>
+    auto Selection<E,T>::attr(const K& key, P&& projection, const S& scale) -> selection_type& {
+        _check_data_guard();
+        detail::PhaseScope<E> scope(document, Stats::CALL, "Selection::attr");
+        
+        std::unique_ptr<AttributeScratch> local_scratch;
+        auto &column = _scratch(local_scratch).column;
+        auto n = elements.size();
+        column.resize(n);
+        
+        auto values = column.data();
+        for (std::size_t i=0;i<n;++i)
+            values[i] = (double) projection(elements[i].element, elements[i].value);
+        
+        scale.apply(values, n);
+        
+        auto attribute_key = AttributeTraits<E>::key(key);
+        for (std::size_t i=0;i<n;++i)
+            AttributeTraits<E>::set_number(elements[i].element, attribute_key, values[i]);
+        
+        _notify_update();
+        return *this;
+    }
+    
+    template<typename E, typename T>
+    template<typename P, typename U>
+    auto Selection<E,T>::joinChildren(P&& predicate, const std::vector<U>& data) -> ChildrenJoin<E,T,P,detail::SharedData<U>> {
+        return ChildrenJoin<E,T,P,detail::SharedData<U>>(*this, std::forward<P>(predicate), detail::SharedData<U> { data },
+                                                         detail::NoEnter(), detail::NoExit(), false);
+    }
+    
+    template<typename E, typename T>
+    template<typename P, typename F, typename, typename>
+    auto Selection<E,T>::joinChildren(P&& predicate, F&& mapping) -> ChildrenJoin<E,T,P,detail::MappedData<F>> {
+        return ChildrenJoin<E,T,P,detail::MappedData<F>>(*this, std::forward<P>(predicate), detail::MappedData<F> { std::forward<F>(mapping) },
+                                                         detail::NoEnter(), detail::NoExit(), false);
+    }
+    
+    template<typename E, typename T>
+    auto Selection<E,T>::transition(double duration, ease::function_type ease) -> SelectionTransition<E,T> {
+        if (!document)
+            throw std::runtime_error("transition needs a selection with a document");
+        std::vector<E*> targets;
+        targets.reserve(elements.size());
+        for (auto &ev: elements)
+            targets.push_back(ev.element);
+        return SelectionTransition<E,T>(*this, document->transitions().add(std::move(targets), duration, ease));
+    }
+    
+    template<typename E, typename T>
+    void Selection<E,T>::_check_data_guard() const {
+        if (data_guard && !data_guard->valid())
+            throw std::runtime_error("data bound by reference was destroyed, resized or reallocated");
+    }
+    
+    template<typename E, typename T>
+    ThreadPool& Selection<E,T>::_thread_pool(const execution::Parallel &policy) {
+        if (policy.pool)
+            return *policy.pool;
+        else if (document)
+            return document->thread_pool();
+        else
+            return default_thread_pool();
+    }
+    
+    template<typename E, typename T>
+    std::ostream& operator<<(std::ostream &os, const Selection<E,T>& sel) {
+        os << "[selection]" << std::endl;
+        for (auto &g: sel.groups) {
+            os << "    [group]" << std::endl;
+            os << "        [parent_node]  <" << ">" << std::endl;
+            for (auto &ev: sel.elements_of(g)) {
+                os << "            [element]  <" << ">" << std::endl;
+            }
+        }
+        return os;
+    }
+    
+    
+    //------------------------------------------------------------------------------
+    // ExitSelection Impl.
+    //------------------------------------------------------------------------------
+    
+    template <typename E>
+    auto ExitSelection<E>::_group_add(E* parent) -> group_type& {
+        groups.push_back(group_type(parent, elements.size()));
+        return groups.back();
+    }
+    
+    template <typename E>
+    void ExitSelection<E>::_element_add(E* e) {
+        elements.push_back(e);
+        ++groups.back().count;
+    }
+    
+    template <typename E>
+    auto ExitSelection<E>::elements_of(const group_type &g) const -> range_type {
+        auto first = elements.data() + g.offset;
+        return { first, first + g.count };
+    }
+    
+    template <typename E>
+    std::size_t ExitSelection<E>::size() const {
+        return elements.size();
+    }
+    
+    template <typename E>
+    bool ExitSelection<E>::empty() const {
+        return elements.empty();
+    }
+    
+    template <typename E>
+    auto ExitSelection<E>::call(call_type f) -> exit_selection_type& {
+        _call(f);
+        return *this;
+    }
+    
+    template <typename E>
+    template <typename F, typename>
+    auto ExitSelection<E>::call(F&& f) -> exit_selection_type& {
+        _call(f);
+        return *this;
+    }
+    
+    template <typename E>
+    template <typename F>
+    void ExitSelection<E>::_call(F &f) {
+        detail::PhaseScope<E> scope(document, Stats::CALL, "ExitSelection::call");
+        for (auto e: elements)
+            f(e);
+        if (document && document->_observed()) {
+            for (auto e: elements)
+                document->_notify_update(e);
+        }
+    }
+    
+    template <typename E>
+    auto ExitSelection<E>::remove(remove_from_document_function_type remove_from_document_function) -> exit_selection_type& {
+        _remove(remove_from_document_function);
+        return *this;
+    }
+    
+    template <typename E>
+    template <typename F, typename>
+    auto ExitSelection<E>::remove(F&& remove_from_document_function) -> exit_selection_type& {
+        _remove(remove_from_document_function);
+        return *this;
+    }
+    
+    template <typename E>
+    template <typename F>
+    void ExitSelection<E>::_remove(F &remove_from_document_function) {
+        detail::PhaseScope<E> scope(document, Stats::REMOVE, "ExitSelection::remove");
+        for (auto e: elements) {
+            if (document)
+                document->_notify_remove(e);
+            remove_from_document_function(e);
+        }
+        elements.clear();
         for (auto &g: groups) {
-            auto new_child_element = append_function(g->parent_node);
-            result._group_add(g->parent_node, new_child_element);
+            g.offset = 0;
+            g.count  = 0;
         }
-        return result;
     }
     
-    template <typename E, typename T>
-    template <typename U>
-    Selection<E,U> Selection<E,T>::data(const std::vector<U>& data) {
-        Selection<E,U> result;
+    template <typename E>
+    auto ExitSelection<E>::remove() -> exit_selection_type& {
         
-        // just the bare update part here... not enter or exit
-        // match by index
+        detail::PhaseScope<E> scope(document, Stats::REMOVE, "ExitSelection::remove");
+        
+        // elements are bucketed by parent (input order kept, usually runs
+        // of siblings in index order) and parents compacted deepest
+        // first: an element is never reached through an ancestor erased
+        // in this same batch
+        struct Parent {
+            E*          parent;
+            std::size_t depth;
+            std::size_t offset;
+            std::size_t count;
+            bool        by_address; // bucket not in child order: searched
+        };
         
-        result._enterSelection_init(data);
-        Selection<E,U>& exit_selection = result._exitSelection_init();
+        std::vector<Parent>                   parents;
+        std::unordered_map<E*, std::size_t>   slots;
+        std::vector<std::size_t>              slot_of(elements.size(), ~std::size_t(0));
+        std::size_t slot = 0;
+        for (std::size_t i=0;i<elements.size();++i) {
+            auto parent = TreeTraits<E>::parent(elements[i]);
+            if (!parent)
+                continue; // the root stays
+            if (parents.empty() || parents[slot].parent != parent) {
+                auto it = slots.find(parent);
+                if (it == slots.end()) {
+                    std::size_t depth = 0;
+                    for (auto x = parent;x;x = TreeTraits<E>::parent(x))
+                        ++depth;
+                    it = slots.insert({parent, parents.size()}).first;
+                    parents.push_back({parent, depth, 0, 0, false});
+                }
+                slot = it->second;
+            }
+            slot_of[i] = slot;
+            ++parents[slot].count;
+        }
         
-        for (auto &g: groups) {
-            
-            auto &new_group = result._group_add(g->parent.element);
-            
-            auto it_data     = data.begin();
-            auto it_data_end = data.end();
-
-            auto it_ev       = g->elements.begin();
-            auto it_ev_end   = g->elements.end();
-
-            
-            auto index = 0;
-            for (;it_data!= it_data_end && it_ev != it_ev_end ;++it_data,++it_ev) {
-                new_group.add(it_ev->element, *it_data);
-                ++index;
+        std::size_t offset = 0;
+        for (auto &p: parents) {
+            p.offset = offset;
+            offset  += p.count;
+            p.count  = 0;
+        }
+        using removed_type = std::pair<std::size_t, E*>; // (index, element)
+        std::vector<removed_type> removed(offset);
+        for (std::size_t i=0;i<elements.size();++i) {
+            if (slot_of[i] != ~std::size_t(0)) {
+                auto &p = parents[slot_of[i]];
+                removed[p.offset + p.count++] = { TreeTraits<E>::index(elements[i]), elements[i] };
             }
+        }
+        
+        auto by_address = [](const removed_type &a, const removed_type &b) { return a.second < b.second; };
+        auto contains   = [&](const Parent &p, E* child) {
+            auto first = removed.begin() + p.offset;
+            auto last  = first + p.count;
+            auto it    = std::lower_bound(first, last, removed_type { 0, child }, by_address);
+            return it != last && it->second == child;
+        };
+        
+        // only elements found among their parent's children are notified
+        // (in child order, while the subtrees can still be walked) and
+        // erased. sorted by index, a bucket matches the children in
+        // lockstep; a stale index or a detached element breaks that, and
+        // the bucket is then sorted by address and searched instead
+        for (auto &p: parents) {
+            auto first = removed.begin() + p.offset;
+            auto last  = first + p.count;
+            if (!std::is_sorted(first, last))
+                std::sort(first, last);
+            last    = std::unique(first, last);
+            p.count = (std::size_t) (last - first);
             
-            //
-            // this is still wrong
-            //
-            
-            result._enterSelection_add(&new_group,index);
+            auto next = first;
+            TreeTraits<E>::for_each_child(p.parent, [&](E* child) {
+                if (next != last && next->second == child)
+                    ++next;
+            });
+            if (next == last) {
+                if (document) {
+                    for (auto it=first;it!=last;++it)
+                        document->_notify_remove(it->second);
+                }
+                continue;
+            }
             
-            using ev_type = decltype(*it_ev);
-            if (it_ev != g->elements.end()) {
-                auto &exit_group = exit_selection._group_add(g->parent.element);
-                std::for_each(it_ev, it_ev_end, [&exit_group](const ev_type &ev) {
-                    // std::cerr << "will remove element" << ev.element << std::endl;
-                    exit_group.add(ev.element);
+            p.by_address = true;
+            std::sort(first, last, by_address);
+            p.count = (std::size_t) (std::unique(first, last, [](const removed_type &a, const removed_type &b) {
+                return a.second == b.second;
+            }) - first);
+            if (document) {
+                TreeTraits<E>::for_each_child(p.parent, [&](E* child) {
+                    if (contains(p, child))
+                        document->_notify_remove(child);
                 });
             }
         }
         
-        return result;
+        std::stable_sort(parents.begin(), parents.end(), [](const Parent &a, const Parent &b) {
+            return a.depth > b.depth;
+        });
+        
+        for (auto &p: parents) {
+            if (p.by_address) {
+                TreeTraits<E>::erase_children(p.parent, [&](E* child) { return contains(p, child); });
+                continue;
+            }
+            auto first = removed.begin() + p.offset;
+            auto last  = first + p.count;
+            TreeTraits<E>::erase_children(p.parent, [&](E* child) {
+                if (first != last && first->second == child) {
+                    ++first;
+                    return true;
+                }
+                return false;
+            });
+        }
+        
+        elements.clear();
+        for (auto &g: groups) {
+            g.offset = 0;
+            g.count  = 0;
+        }
+        return *this;
+    }
+    
+    //------------------------------------------------------------------------------
+    // EnterSelection::Entry Impl.
+    //------------------------------------------------------------------------------
+    
+    template <typename E, typename T>
+    EnterSelection<E,T>::Entry::Entry(group_type* group, int index):
+    group(group),
+    index(index)
+    {}
+    
+    //------------------------------------------------------------------------------
+    // EnterSelection Impl.
+    //------------------------------------------------------------------------------
+    
+    template <typename E, typename T>
+    EnterSelection<E,T>::EnterSelection(selection_type *update_selection, const std::vector<T> &shared_data):
+    update_selection(update_selection),
+    mode(SINGLE_SHARED_LIST)
+    {
+        enter_data.push_back(shared_data);
+    }
+
+    template <typename E, typename T>
+    EnterSelection<E,T>::EnterSelection(selection_type *update_selection, std::vector<T> &&shared_data):
+    mode(SINGLE_SHARED_LIST),
+    update_selection(update_selection)
+    {
+        enter_data.push_back(std::move(shared_data));
     }
 
+    template <typename E, typename T>
+    EnterSelection<E,T>::EnterSelection(selection_type *update_selection):
+    update_selection(update_selection),
+    mode(ONE_LIST_PER_GROUP)
+    {}
     
     template <typename E, typename T>
-    template <typename U, typename K>
-    Selection<E,U> Selection<E,T>::data(const std::vector<U>& data,
-                                        std::function<K(const U&)> data2key,
-                                        std::function<K(const E&)> elem2key)
-    {
+    auto EnterSelection<E,T>::_add(group_type* update_selection_group, int index) -> enter_selection_type& {
         
+        if (mode != SINGLE_SHARED_LIST)
+            throw std::runtime_error("incompatible add when adding without a list should be in SINGLE_SHARED_MODE");
         
-        using result_selection_type = Selection<E,U>;
-        using result_group_type     = typename result_selection_type::group_type;
+        entries.push_back({update_selection_group, index});
+        return *this;
+    }
+
+    template <typename E, typename T>
+    auto EnterSelection<E,T>::_add(group_type* update_selection_group, int index, const std::vector<T> &group_data) -> enter_selection_type& {
         
-        result_selection_type result;
+        if (mode != ONE_LIST_PER_GROUP)
+            throw std::runtime_error("incompatible add when adding without a list should be in ONE_LIST_PER_GROUP");
         
-        // just the bare update part here... not enter or exit
-        // match by index
+        entries.push_back({update_selection_group, index});
+        enter_data.push_back(group_data);
+        return *this;
+    }
+
+    template <typename E, typename T>
+    auto EnterSelection<E,T>::_add(group_type* update_selection_group, int index, std::vector<T> &&group_data) -> enter_selection_type& {
         
-        result._enterSelection_init();
-        Selection<E,U>& exit_selection = result._exitSelection_init();
+        if (mode != ONE_LIST_PER_GROUP)
+            throw std::runtime_error("incompatible add when adding without a list should be in ONE_LIST_PER_GROUP");
         
-        //
-        std::unordered_map<K,const U*> key2data;
-        std::for_each(data.begin(), data.end(), [&](const U& d) {
-            key2data[data2key(d)] = &d;
-        });
+        entries.push_back({update_selection_group, index});
+        enter_data.push_back(std::move(group_data));
+        return *this;
+    }
+
+    template <typename E, typename T>
+    auto EnterSelection<E,T>::append(append_function_type append) -> selection_type {
+        return _append(append);
+    }
+    
+    template <typename E, typename T>
+    template <typename F, typename>
+    auto EnterSelection<E,T>::append(F&& append) -> selection_type {
+        return _append(append);
+    }
+    
+    template <typename E, typename T>
+    template <typename F>
+    auto EnterSelection<E,T>::_append(F &append) -> selection_type {
+        update_selection->_check_data_guard();
         
-        for (auto &g: groups) {
+        detail::PhaseScope<E> scope(update_selection->document, Stats::APPEND, "EnterSelection::append");
+        
+        selection_type result;
+        result.document   = update_selection->document;
+        result.data_guard = update_selection->data_guard;
+        
+        std::vector<group_type*> targets;
+        targets.reserve(entries.size());
+        
+        std::size_t index = 0;
+        for (auto &e: entries) {
+            result._group_add(e.group->parent);
+            targets.push_back(e.group);
             
-            auto &new_group = result._group_add(g->parent.element);
-
-            result_group_type* exit_group = nullptr;
+            auto &data = (mode == SINGLE_SHARED_LIST) ? enter_data.at(0) : enter_data.at(index);
             
-            for (auto &e: g->elements) {
-                auto k = elem2key(*e.element);
-                
-                auto it = key2data.find(k);
-                
-                if (it == key2data.end()) {
-                    if (!exit_group) {
-                        exit_group = &exit_selection._group_add(g->parent.element);
-                    }
-                    exit_group->add(e.element);
-                }
-                else {
-                    new_group.add(e.element, *it->second);
-                    key2data.erase(it);
-                }
+            // a shared list is read by every entry: the last one moves
+            bool consume = mode == ONE_LIST_PER_GROUP || index + 1 == entries.size();
+            
+            auto document = update_selection->document;
+            auto parent   = e.group->parent.element;
+            
+            if (data.size() > (std::size_t) e.index) {
+                TreeTraits<E>::reserve_children(parent, data.size() - e.index);
+                result.elements.reserve(result.elements.size() + data.size() - e.index);
             }
             
-            if (key2data.size() > 0) {
-                std::vector<U> enter_data_for_g;
-                enter_data_for_g.reserve(key2data.size());
-                for (auto it: key2data) {
-                    enter_data_for_g.push_back(*it.second);
-                }
-                result._enterSelection_add(&new_group, 0, enter_data_for_g); // might use move semantics for vectors here
+            for (auto it=data.begin() + e.index;it!=data.end();++it) {
+                auto new_element = append(parent, *it); // could use the data
+                if (document)
+                    document->_notify_append(parent, new_element);
+                if (consume)
+                    result._element_add(new_element, std::move(*it));
+                else
+                    result._element_add(new_element, *it);
             }
+            ++index;
         }
+        entries.clear();
+        enter_data.clear();
         
+        // entered elements join the end of their update groups
+        update_selection->_append_to_groups(targets, result);
+        scope.built(result);
         return result;
     }
-
-    
-    
-    
     
     template <typename E, typename T>
-    template <typename U>
-    Selection<E,U> Selection<E,T>::data(std::function<std::vector<U>(const T&)> mapping) {
-        Selection<E,U> result;
+    template <typename F>
+    auto EnterSelection<E,T>::append_bulk(F&& append) -> selection_type {
+        update_selection->_check_data_guard();
         
-        // just the bare update part here... not enter or exit
-        // match by index
-
-        result._enterSelection_init();
-
-        Selection<E,U>& exit_selection = result._exitSelection_init();
+        detail::PhaseScope<E> scope(update_selection->document, Stats::APPEND, "EnterSelection::append_bulk");
         
-        for (auto &g: groups) {
-
-            auto data = mapping(g->parent.value);
-            
-            auto &new_group = result._group_add(g->parent.element);
+        selection_type result;
+        result.document   = update_selection->document;
+        result.data_guard = update_selection->data_guard;
+        
+        std::vector<group_type*> targets;
+        targets.reserve(entries.size());
+        
+        std::vector<E*> appended;
+        for (std::size_t k=0;k<entries.size();++k) {
+            auto &e = entries[k];
+            result._group_add(e.group->parent);
+            targets.push_back(e.group);
             
-            auto it_data     = data.begin();
-            auto it_data_end = data.end();
+            auto &data  = (mode == SINGLE_SHARED_LIST) ? enter_data.at(0) : enter_data.at(k);
+            auto first  = data.cbegin() + std::min<std::size_t>(e.index, data.size());
+            auto count  = (std::size_t) (data.cend() - first);
+            auto parent = e.group->parent.element;
+            if (count == 0)
+                continue;
             
-            auto it_ev       = g->elements.begin();
-            auto it_ev_end   = g->elements.end();
+            TreeTraits<E>::reserve_children(parent, count);
+            result.elements.reserve(result.elements.size() + count);
             
-            auto index = 0;
-            for (;it_data!= it_data_end && it_ev != it_ev_end ;++it_data,++it_ev) {
-                new_group.add(it_ev->element, *it_data);
-                ++index;
-            }
+            appended.clear();
+            append(parent, data_range_type { first, data.cend() }, appended);
+            if (appended.size() != count)
+                throw std::runtime_error("append_bulk: one element per entering datum expected");
             
-            //
-            // this is still wrong
-            //
             
-            result._enterSelection_add(&new_group,index,data);
+            // a shared list is read by every entry: the last one moves
+            bool consume  = mode == ONE_LIST_PER_GROUP || k + 1 == entries.size();
+            auto document = update_selection->document;
             
-            using ev_type = decltype(*it_ev);
-            if (it_ev != g->elements.end()) {
-                auto &exit_group = exit_selection._group_add(g->parent.element);
-                std::for_each(it_ev, it_ev_end, [&exit_group](const ev_type &ev) {
-                    // std::cerr << "will remove element" << ev.element << std::endl;
-                    exit_group.add(ev.element);
-                });
+            auto it = data.begin() + (first - data.cbegin());
+            for (auto new_element: appended) {
+                if (document)
+                    document->_notify_append(parent, new_element);
+                if (consume)
+                    result._element_add(new_element, std::move(*it));
+                else
+                    result._element_add(new_element, *it);
+                ++it;
             }
         }
+        entries.clear();
+        enter_data.clear();
         
+        update_selection->_append_to_groups(targets, result);
+        scope.built(result);
         return result;
     }
     
+    //------------------------------------------------------------------------------
+    // Document Impl.
+    //------------------------------------------------------------------------------
     
+    template <typename E>
+    Document<E>::Document(E* root):
+    root(root)
+    {}
     
+    template <typename E>
+    template<typename I>
+    auto Document<E>::selectAll(predicate_type predicate, std::function<I(E*)> gen_iterator) -> selection_type {
+        return _selectAll(predicate, gen_iterator);
+    }
     
+    template <typename E>
+    template<typename P, typename G, typename>
+    auto Document<E>::selectAll(P&& predicate, G&& gen_iterator) -> selection_type {
+        return _selectAll(predicate, gen_iterator);
+    }
     
-    template <typename E, typename T>
-    template <typename U, typename K>
-    Selection<E,U> Selection<E,T>::data(std::function<std::vector<U>(const T&)> mapping,
-                                        std::function<K(const U&)> data2key,
-                                        std::function<K(const E&)> elem2key)
-    {
-        
+    template <typename E>
+    template<typename P, typename G>
+    auto Document<E>::selectAll(const execution::Parallel &policy, P&& predicate, G&& gen_iterator) -> selection_type {
         
-        using result_selection_type = Selection<E,U>;
-        using result_group_type     = typename result_selection_type::group_type;
+        if (!root)
+            throw std::runtime_error("oooops");
         
-        result_selection_type result;
+        detail::PhaseScope<E> scope(this, Stats::SELECT, "Document::selectAll parallel");
         
+        selection_type result;
+        result.document = this;
+        result._group_add(root);
         
+        std::vector<E*> roots { root };
+        selection_type::_selectAll_parallel(policy.pool ? *policy.pool : thread_pool(), roots, predicate, gen_iterator, result, scope);
+        scope.built(result);
+        return result;
+    }
+    
+    template <typename E>
+    template<typename P, typename G>
+    auto Document<E>::_selectAll(P &predicate, G &gen_iterator) -> selection_type {
         
-        // just the bare update part here... not enter or exit
-        // match by index
+        if (!root)
+            throw std::runtime_error("oooops");
         
-        result._enterSelection_init();
+        detail::PhaseScope<E> scope(this, Stats::SELECT, "Document::selectAll");
         
-        Selection<E,U>& exit_selection = result._exitSelection_init();
+        selection_type result; // int is the default placeholder for data
+        result.document = this;
+        result._group_add(root);
         
-        for (auto &g: groups) {
-            
-            auto data = mapping(g->parent.value);
-            
-            std::unordered_map<K,const U*> key2data;
-            std::for_each(data.begin(), data.end(), [&](const U& d) {
-                key2data[data2key(d)] = &d;
-            });
-            
-            auto &new_group = result._group_add(g->parent.element);
-            
-            result_group_type* exit_group = nullptr;
-            
-            for (auto &e: g->elements) {
-                auto k = elem2key(*e.element);
-                
-                auto it = key2data.find(k);
-                
-                if (it == key2data.end()) {
-                    if (!exit_group) {
-                        exit_group = &exit_selection._group_add(g->parent.element);
-                    }
-                    exit_group->add(e.element);
-                }
-                else {
-                    new_group.add(e.element, *it->second);
-                    key2data.erase(it);
-                }
-            }
-            
-            if (key2data.size() > 0) {
-                std::vector<U> enter_data_for_g;
-                enter_data_for_g.reserve(key2data.size());
-                for (auto it: key2data) {
-                    enter_data_for_g.push_back(*it.second);
-                }
-                result._enterSelection_add(&new_group, 0, enter_data_for_g); // might use move semantics for vectors here
+        std::size_t visited = 0;
+        auto it = gen_iterator(root);
+        while (auto e = it.next()) {
+            ++visited;
+            if (predicate(e)) {
+                result._element_add(e);
             }
         }
+        scope.visited(visited, visited);
+        scope.built(result);
+        return result;
+    }
+    
+    template <typename E>
+    template<typename V>
+    auto Document<E>::selectAll(V&& visitor) -> selection_type {
+        
+        if (!root)
+            throw std::runtime_error("oooops");
+        
+        detail::PhaseScope<E> scope(this, Stats::SELECT, "Document::selectAll visitor");
+        
+        selection_type result;
+        result.document = this;
+        result._group_add(root);
         
+        result._visit(root, true, visitor, scratch<TraversalScratch<E>>().stack, scope);
+        scope.built(result);
         return result;
-
     }
-
     
+    template <typename E>
+    void Document<E>::observe(DocumentObserver<E> *observer) {
+        observers.push_back(observer);
+    }
+    
+    template <typename E>
+    void Document<E>::unobserve(DocumentObserver<E> *observer) {
+        observers.erase(std::remove(observers.begin(), observers.end(), observer), observers.end());
+    }
+    
+    template <typename E>
+    void Document<E>::_notify_append(E* parent, E* element) {
+        for (auto observer: observers)
+            observer->on_append(parent, element);
+    }
+    
+    template <typename E>
+    void Document<E>::_notify_remove(E* element) {
+        for (auto observer: observers)
+            observer->on_remove(element);
+    }
+    
+    template <typename E>
+    void Document<E>::_notify_update(E* element) {
+        for (auto observer: observers)
+            observer->on_update(element);
+    }
+    
+    template <typename E>
+    bool Document<E>::_observed() const {
+        return !observers.empty();
+    }
+    
+    template <typename E>
+    TagIndex<E>& Document<E>::index_tags(std::function<std::string(const E*)> tag_function) {
+        tag_index.reset(); // unobserve before the new index observes
+        auto index = new TagIndex<E>(*this, tag_function);
+        tag_index.reset(index);
+        return *index;
+    }
+    
+    template <typename E>
+    TagIndex<E>& Document<E>::_tags() {
+        if (!tag_index)
+            throw std::runtime_error("selectTag needs a tag index (see index_tags)");
+        return static_cast<TagIndex<E>&>(*tag_index);
+    }
+    
+    template <typename E>
+    auto Document<E>::selectTag(const std::string &tag) -> selection_type {
+        auto &index = _tags();
+        detail::PhaseScope<E> scope(this, Stats::SELECT, "Document::selectTag");
+        auto result = _selection(index.elements(tag));
+        scope.visited(result.size(), 0);
+        scope.built(result);
+        return result;
+    }
+    
+    template <typename E>
+    template <typename P>
+    auto Document<E>::selectTag(const std::string &tag, P&& predicate) -> selection_type {
+        auto &index = _tags();
+        
+        detail::PhaseScope<E> scope(this, Stats::SELECT, "Document::selectTag");
+        
+        selection_type result;
+        result.document = this;
+        result._group_add(root);
+        auto &elements = index.elements(tag);
+        for (auto e: elements) {
+            if (predicate(e))
+                result._element_add(e);
+        }
+        scope.visited(elements.size(), elements.size());
+        scope.built(result);
+        return result;
+    }
+    
+    template <typename E>
+    auto Document<E>::_selection(const std::vector<E*> &elements) -> selection_type {
+        selection_type result;
+        result.document = this;
+        auto &group = result._group_add(root);
+        result.elements.assign(elements.begin(), elements.end());
+        group.count = elements.size();
+        return result;
+    }
+    
+    template <typename E>
+    Transitions<E>& Document<E>::transitions() {
+        if (!scheduler)
+            scheduler.reset(new Transitions<E>(*this));
+        return static_cast<Transitions<E>&>(*scheduler);
+    }
+    
+    template <typename E>
+    Stats Document<E>::stats() const {
+        return counters;
+    }
+    
+    template <typename E>
+    void Document<E>::reset_stats() {
+        counters = Stats();
+    }
+    
+    template <typename E>
+    ThreadPool& Document<E>::thread_pool() {
+        if (!pool)
+            pool = std::make_shared<ThreadPool>();
+        return *pool.get();
+    }
+    
+    template <typename E>
+    void Document<E>::thread_pool(std::shared_ptr<ThreadPool> pool) {
+        this->pool = pool;
+    }
+    
+    template <typename E>
+    template <typename S>
+    S& Document<E>::scratch() {
+        auto &buffer = scratch_buffers[std::type_index(typeid(S))];
+        if (!buffer)
+            buffer = std::make_shared<S>();
+        return *static_cast<S*>(buffer.get());
+    }
+    
+    //------------------------------------------------------------------------------
+    // OrderedElements Impl.
+    //------------------------------------------------------------------------------
+    
+    template <typename E>
+    void OrderedElements<E>::insert(E* e) {
+        inserted.insert(e);
+    }
+    
+    template <typename E>
+    void OrderedElements<E>::erase(E* e) {
+        // e's address can be reused by a later insert: that one lives in
+        // inserted and erased only filters ordered
+        inserted.erase(e);
+        erased.insert(e);
+    }
+    
+    template <typename E>
+    void OrderedElements<E>::push_back(E* e) {
+        ordered.push_back(e);
+    }
+    
+    template <typename E>
+    auto OrderedElements<E>::elements() -> const std::vector<E*>& {
+        // drop erased elements first: the merge below compares elements
+        // and erased ones may be gone
+        if (!erased.empty()) {
+            ordered.erase(std::remove_if(ordered.begin(), ordered.end(), [this](E* e) {
+                return erased.count(e) > 0;
+            }), ordered.end());
+            erased.clear();
+        }
+        
+        if (!inserted.empty()) {
+            auto order = [](E* a, E* b) { return TreeTraits<E>::document_order(a, b); };
+            
+            buffer.assign(inserted.begin(), inserted.end());
+            inserted.clear();
+            std::sort(buffer.begin(), buffer.end(), order);
+            
+            auto middle = ordered.size();
+            ordered.insert(ordered.end(), buffer.begin(), buffer.end());
+            auto first = std::upper_bound(ordered.begin(), ordered.begin() + middle, buffer.front(), order);
+            std::inplace_merge(first, ordered.begin() + middle, ordered.end(), order);
+        }
+        return ordered;
+    }
     
+    //------------------------------------------------------------------------------
+    // LiveSelection Impl.
+    //------------------------------------------------------------------------------
     
+    template <typename E>
+    LiveSelection<E>::LiveSelection(document_type &document, predicate_type predicate):
+    document(document),
+    predicate(predicate)
+    {
+        if (document.root) {
+            TreeTraits<E>::for_each_in_subtree(document.root, [this](E* e) {
+                if (this->predicate(e))
+                    matches.push_back(e);
+            });
+        }
+        document.observe(this);
+    }
     
+    template <typename E>
+    LiveSelection<E>::~LiveSelection() {
+        document.unobserve(this);
+    }
     
+    template <typename E>
+    void LiveSelection<E>::on_append(E*, E* element) {
+        TreeTraits<E>::for_each_in_subtree(element, [this](E* e) {
+            if (predicate(e))
+                matches.insert(e);
+        });
+    }
     
+    template <typename E>
+    void LiveSelection<E>::on_remove(E* element) {
+        // the whole subtree, matching or not: the predicate might have
+        // changed its mind since the element was added
+        TreeTraits<E>::for_each_in_subtree(element, [this](E* e) {
+            matches.erase(e);
+        });
+    }
     
+    template <typename E>
+    auto LiveSelection<E>::elements() -> const std::vector<E*>& {
+        return matches.elements();
+    }
     
+    template <typename E>
+    auto LiveSelection<E>::selection() -> selection_type {
+        return document._selection(matches.elements());
+    }
     
+    //------------------------------------------------------------------------------
+    // TagIndex Impl.
+    //------------------------------------------------------------------------------
     
+    template <typename E>
+    const std::uint32_t TagIndex<E>::none;
     
+    template <typename E>
+    TagIndex<E>::TagIndex(document_type &document, tag_function_type tag_function):
+    document(document),
+    tag_function(tag_function)
+    {
+        if (document.root) {
+            TreeTraits<E>::for_each_in_subtree(document.root, [this](E* e) {
+                lists[intern(this->tag_function(e))].push_back(e);
+            });
+        }
+        document.observe(this);
+    }
     
+    template <typename E>
+    TagIndex<E>::~TagIndex() {
+        document.unobserve(this);
+    }
     
+    template <typename E>
+    std::uint32_t TagIndex<E>::intern(const std::string &tag) {
+        auto it = tag_ids.find(tag);
+        if (it != tag_ids.end())
+            return it->second;
+        auto id = (std::uint32_t) lists.size();
+        tag_ids.insert({tag, id});
+        lists.push_back(OrderedElements<E>());
+        return id;
+    }
     
+    template <typename E>
+    std::uint32_t TagIndex<E>::find(const std::string &tag) const {
+        auto it = tag_ids.find(tag);
+        return it != tag_ids.end() ? it->second : none;
+    }
     
+    template <typename E>
+    auto TagIndex<E>::elements(const std::string &tag) -> const std::vector<E*>& {
+        auto id = find(tag);
+        if (id == none)
+            return empty;
+        return lists[id].elements();
+    }
     
+    template <typename E>
+    void TagIndex<E>::on_append(E*, E* element) {
+        TreeTraits<E>::for_each_in_subtree(element, [this](E* e) {
+            lists[intern(tag_function(e))].insert(e);
+        });
+    }
     
+    template <typename E>
+    void TagIndex<E>::on_remove(E* element) {
+        TreeTraits<E>::for_each_in_subtree(element, [this](E* e) {
+            auto id = find(tag_function(e));
+            if (id != none)
+                lists[id].erase(e);
+        });
+    }
     
+    //------------------------------------------------------------------------------
+    // Journal Impl.
+    //------------------------------------------------------------------------------
     
+    template <typename E>
+    Journal<E>::Journal(document_type &document):
+    document(document)
+    {
+        if (document.root) {
+            TreeTraits<E>::for_each_in_subtree(document.root, [this](E* e) {
+                ids[e] = next_id++;
+            });
+        }
+        frame_id = next_id;
+        document.observe(this);
+    }
     
-    template<typename E, typename T>
-    auto Selection<E,T>::_enterSelection_init(const std::vector<T>& extra_data) -> enter_selection_type& {
-        enter_selection.reset(new enter_selection_type(this,extra_data));
-        return *enter_selection.get();
+    template <typename E>
+    Journal<E>::~Journal() {
+        document.unobserve(this);
     }
     
-    template<typename E, typename T>
-    void Selection<E,T>::_enterSelection_add(group_type *main_selection_parent_children, int index) {
-        if (!enter_selection)
-            throw std::runtime_error("ooops");
-        enter_selection->_add(main_selection_parent_children,index);
+    template <typename E>
+    auto Journal<E>::id(E* element) const -> id_type {
+        return ids.at(element);
     }
-
-    template<typename E, typename T>
-    auto Selection<E,T>::_enterSelection_init() -> enter_selection_type& {
-        enter_selection.reset(new enter_selection_type(this));
-        return *enter_selection.get();
+    
+    template <typename E>
+    void Journal<E>::on_append(E*, E* element) {
+        TreeTraits<E>::for_each_in_subtree(element, [this](E* e) {
+            auto id = next_id++;
+            ids[e] = id;
+            changes.push_back({APPEND, id, e});
+        });
     }
     
-    template<typename E, typename T>
-    void Selection<E,T>::_enterSelection_add(group_type *main_selection_parent_children, int index, const std::vector<T>& group_data) {
-        if (!enter_selection)
-            throw std::runtime_error("ooops");
-        enter_selection->_add(main_selection_parent_children,index,group_data);
+    template <typename E>
+    void Journal<E>::on_remove(E* element) {
+        auto it = ids.find(element);
+        if (it == ids.end())
+            return;
+        changes.push_back({REMOVE, it->second, nullptr});
+        TreeTraits<E>::for_each_in_subtree(element, [this](E* e) {
+            auto it = ids.find(e);
+            if (it != ids.end()) {
+                removed.insert(it->second);
+                ids.erase(it);
+            }
+        });
     }
-
-    template<typename E, typename T>
-    auto Selection<E,T>::_exitSelection_init() -> selection_type& {
-        exit_selection.reset(new selection_type());
-        return *exit_selection.get();
+    
+    template <typename E>
+    void Journal<E>::on_update(E* element) {
+        auto it = ids.find(element);
+        if (it != ids.end() && it->second < frame_id)
+            changes.push_back({UPDATE, it->second, element});
     }
     
-    template<typename E, typename T>
-    auto Selection<E,T>::enter() -> enter_selection_type& {
-        return *enter_selection.get();
+    template <typename E>
+    template <typename F>
+    void Journal<E>::patch(std::string &out, F&& write_element) {
+        
+        // pointers of removed elements are never dereferenced
+        for (auto &c: changes) {
+            if (c.op == REMOVE && c.id < frame_id) {
+                out += "- ";
+                out += std::to_string(c.id);
+                out += '\n';
+            }
+        }
+        
+        for (auto &c: changes) {
+            if (c.op != APPEND || removed.count(c.id))
+                continue;
+            out += "+ ";
+            out += std::to_string(c.id);
+            out += ' ';
+            out += std::to_string(ids.at(TreeTraits<E>::parent(c.element)));
+            out += ' ';
+            out += std::to_string(TreeTraits<E>::index(c.element));
+            out += ' ';
+            write_element(c.element, out);
+            out += '\n';
+        }
+        
+        for (auto &c: changes) {
+            if (c.op != UPDATE || removed.count(c.id) || !reported.insert(c.id).second)
+                continue;
+            out += "~ ";
+            out += std::to_string(c.id);
+            out += ' ';
+            write_element(c.element, out);
+            out += '\n';
+        }
+        
+        checkpoint();
     }
     
-    template<typename E, typename T>
-    auto Selection<E,T>::exit() -> selection_type& {
-        return *exit_selection.get();
+    template <typename E>
+    void Journal<E>::checkpoint() {
+        changes.clear();
+        removed.clear();
+        reported.clear();
+        frame_id = next_id;
     }
     
-    template<typename E, typename T>
-    template<typename I>
-    auto Selection<E,T>::selectAll(predicate_type predicate, std::function<I(E*)> gen_iterator) -> selection_type {
-        selection_type result;
-        for (auto &group: groups) {
-            for (auto &ev: group->elements) {
-                auto it = gen_iterator(ev.element);
-                group_type& g = result._group_add(ev);
-                while (auto e = it.next()) {
-                    if (predicate(e)) {
-                        g.add(e);
-                    }
+    //------------------------------------------------------------------------------
+    // PhaseScope Impl.
+    //------------------------------------------------------------------------------
+    
+    namespace detail {
+        
+        template <typename E>
+        PhaseScope<E>::PhaseScope(Document<E> *document, Stats::Phase phase, const char *name):
+        phase(phase),
+        trace(name)
+        {
+            if (Stats::enabled && document) {
+                target = &document->counters;
+                start  = std::chrono::steady_clock::now();
+            }
+        }
+        
+        template <typename E>
+        PhaseScope<E>::~PhaseScope() {
+            if (Stats::enabled && target) {
+                auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+                ++target->calls[phase];
+                target->ns[phase] += (std::uint64_t) ns;
+            }
+        }
+        
+        template <typename E>
+        void PhaseScope<E>::visited(std::size_t n, std::size_t predicate_calls) {
+            if (Stats::enabled && target) {
+                target->visited         += n;
+                target->predicate_calls += predicate_calls;
+            }
+        }
+        
+        template <typename E>
+        template <typename I>
+        void PhaseScope<E>::hashed(I &index) {
+            if (Stats::enabled && target) {
+                target->hash_lookups    += index.lookups;
+                target->hash_collisions += index.collisions;
+            }
+            index.lookups    = 0;
+            index.collisions = 0;
+        }
+        
+        template <typename E>
+        template <typename U>
+        void PhaseScope<E>::built(const Selection<E,U> &selection) {
+            if (Tracer::enabled)
+                trace.arg = (std::int64_t) selection.size();
+            if (Stats::enabled && target) {
+                target->bytes += selection.elements.capacity() * sizeof(typename Selection<E,U>::element_value_type)
+                    + selection.groups.size() * sizeof(typename Selection<E,U>::group_type);
+            }
+        }
+        
+        template <typename E>
+        template <typename U>
+        void PhaseScope<E>::joined(const Selection<E,U> &selection) {
+            built(selection);
+            if (!Stats::enabled || !target)
+                return;
+            
+            auto &stats = *target;
+            stats.groups += selection.groups.size();
+            for (auto &g: selection.groups) {
+                stats.update          += g.count;
+                stats.max_group_update = std::max<std::uint64_t>(stats.max_group_update, g.count);
+            }
+            if (auto enter = selection.enter_selection.get()) {
+                for (std::size_t k=0;k<enter->entries.size();++k) {
+                    auto &data = enter->mode == enter->SINGLE_SHARED_LIST ? enter->enter_data.at(0) : enter->enter_data.at(k);
+                    auto index = (std::size_t) enter->entries[k].index;
+                    std::uint64_t n = data.size() > index ? data.size() - index : 0;
+                    stats.enter          += n;
+                    stats.max_group_enter = std::max(stats.max_group_enter, n);
+                }
+            }
+            if (auto exit = selection.exit_selection.get()) {
+                for (auto &g: exit->groups) {
+                    stats.exit          += g.count;
+                    stats.max_group_exit = std::max<std::uint64_t>(stats.max_group_exit, g.count);
                 }
             }
         }
-        return result;
-    }
+        
+    } // detail
     
-    template <typename E, typename T>
-    auto Selection<E,T>::remove(remove_from_document_function_type remove_from_document_function) -> selection_type& {
-        for (auto &g: groups) {
-            for (auto &ev: g->elements) {
-                // std::cerr << "removing element... " << ev.element << std::endl;
-                remove_from_document_function(ev.element);
-            }
-            g->elements.clear();
+    //------------------------------------------------------------------------------
+    // Transition Impl.
+    //------------------------------------------------------------------------------
+    
+    template <typename E>
+    Transition<E>::Transition(std::vector<E*> elements, double duration, ease::function_type ease):
+    elements(std::move(elements)),
+    duration(duration),
+    ease(ease)
+    {}
+    
+    template <typename E>
+    template <typename From, typename To>
+    auto Transition<E>::add_channel(From&& from, To&& to, set_type set) -> Channel& {
+        auto n = elements.size();
+        channels.push_back(Channel());
+        auto &c = channels.back();
+        c.set = std::move(set);
+        c.from.resize(n);
+        c.delta.resize(n);
+        c.last.assign(n, std::numeric_limits<double>::quiet_NaN());
+        for (std::size_t i=0;i<n;++i) {
+            c.from[i]  = from(i);
+            c.delta[i] = to(i) - c.from[i];
         }
-        return *this;
+        return c;
     }
     
-    template<typename E, typename T>
-    auto Selection<E,T>::call(call_type f) -> selection_type& {
-        for (auto &group: groups) {
-            for (auto &ev: group->elements) {
-                f(ev.element, ev.value);
+    template <typename E>
+    bool Transition<E>::tick(double now) {
+        if (!started) {
+            start   = now + delay;
+            started = true;
+        }
+        if (now < start)
+            return true;
+        
+        auto t = duration > 0 ? std::min(1.0, (now - start) / duration) : 1.0;
+        auto k = ease(t);
+        
+        auto n = elements.size();
+        values.resize(n);
+        for (auto &c: channels) {
+            auto from  = c.from.data();
+            auto delta = c.delta.data();
+            auto value = values.data();
+            for (std::size_t i=0;i<n;++i) // vectorized
+                value[i] = from[i] + delta[i] * k;
+            
+            auto last = c.last.data();
+            for (std::size_t i=0;i<n;++i) {
+                if (value[i] != last[i]) {
+                    last[i] = value[i];
+                    c.set(elements[i], value[i]);
+                }
             }
         }
-        return *this;
+        return t < 1.0;
     }
     
-    template<typename E, typename T>
-    std::ostream& operator<<(std::ostream &os, const Selection<E,T>& sel) {
-        os << "[selection]" << std::endl;
-        for (auto &g: sel.groups) {
-            os << "    [group]" << std::endl;
-            os << "        [parent_node]  <" << ">" << std::endl;
-            for (auto &ev: g->elements) {
-                os << "            [element]  <" << ">" << std::endl;
+    template <typename E>
+    void Transition<E>::_drop(const std::unordered_map<E*, std::uint64_t> &removed) {
+        std::size_t kept = 0;
+        for (std::size_t i=0;i<elements.size();++i) {
+            auto it = removed.find(elements[i]);
+            if (it != removed.end() && it->second > created)
+                continue;
+            elements[kept] = elements[i];
+            for (auto &c: channels) {
+                c.from[kept]  = c.from[i];
+                c.delta[kept] = c.delta[i];
+                c.last[kept]  = c.last[i];
             }
+            ++kept;
+        }
+        elements.resize(kept);
+        for (auto &c: channels) {
+            c.from.resize(kept);
+            c.delta.resize(kept);
+            c.last.resize(kept);
         }
-        return os;
     }
     
-    
     //------------------------------------------------------------------------------
-    // EnterSelection::Entry Impl.
+    // Transitions Impl.
     //------------------------------------------------------------------------------
     
-    template <typename E, typename T>
-    EnterSelection<E,T>::Entry::Entry(group_type* group, int index):
-    group(group),
-    index(index)
+    template <typename E>
+    Transitions<E>::Transitions(document_type &document):
+    document(document)
     {}
     
+    template <typename E>
+    Transitions<E>::~Transitions() {
+        if (observing)
+            document.unobserve(this);
+    }
+    
+    template <typename E>
+    Transition<E>& Transitions<E>::add(std::vector<E*> elements, double duration, ease::function_type ease) {
+        if (!observing) {
+            document.observe(this);
+            observing = true;
+        }
+        active.push_back(std::unique_ptr<Transition<E>>(new Transition<E>(std::move(elements), duration, ease)));
+        active.back()->created = ++clock;
+        return *active.back().get();
+    }
+    
+    template <typename E>
+    bool Transitions<E>::tick(double now) {
+        if (!removed.empty()) {
+            for (auto &t: active)
+                t->_drop(removed);
+            removed.clear();
+        }
+        
+        // transitions added by setters (after n) run from the next tick
+        std::size_t kept = 0, n = active.size();
+        for (std::size_t i=0;i<n;++i) {
+            if (active[i]->tick(now))
+                std::swap(active[kept++], active[i]);
+        }
+        active.erase(active.begin() + kept, active.begin() + n);
+        
+        if (active.empty() && observing) {
+            document.unobserve(this);
+            observing = false;
+        }
+        return !active.empty();
+    }
+    
+    template <typename E>
+    std::size_t Transitions<E>::size() const {
+        return active.size();
+    }
+    
+    template <typename E>
+    void Transitions<E>::on_append(E*, E*) {
+    }
+    
+    template <typename E>
+    void Transitions<E>::on_remove(E* element) {
+        auto time = ++clock;
+        TreeTraits<E>::for_each_in_subtree(element, [this, time](E* e) {
+            removed[e] = time;
+        });
+    }
+    
     //------------------------------------------------------------------------------
-    // EnterSelection Impl.
+    // SelectionTransition Impl.
     //------------------------------------------------------------------------------
     
     template <typename E, typename T>
-    EnterSelection<E,T>::EnterSelection(selection_type *update_selection, const std::vector<T> &shared_data):
-    update_selection(update_selection),
-    mode(SINGLE_SHARED_LIST)
-    {
-        enter_data.push_back(shared_data);
-    }
-
-    template <typename E, typename T>
-    EnterSelection<E,T>::EnterSelection(selection_type *update_selection):
-    update_selection(update_selection),
-    mode(ONE_LIST_PER_GROUP)
+    SelectionTransition<E,T>::SelectionTransition(selection_type &selection, transition_type &transition):
+    selection(selection),
+    transition(transition)
     {}
     
     template <typename E, typename T>
-    auto EnterSelection<E,T>::_add(group_type* update_selection_group, int index) -> enter_selection_type& {
-        
-        if (mode != SINGLE_SHARED_LIST)
-            throw std::runtime_error("incompatible add when adding without a list should be in SINGLE_SHARED_MODE");
-        
-        entries.push_back({update_selection_group, index});
+    template <typename From, typename To, typename Set>
+    auto SelectionTransition<E,T>::tween(From&& from, To&& to, Set&& set) -> SelectionTransition& {
+        selection._check_data_guard();
+        auto &elements = selection.elements;
+        transition.add_channel([&](std::size_t i) { return (double) from(elements[i].element, elements[i].value); },
+                               [&](std::size_t i) { return (double) to(elements[i].element, elements[i].value); },
+                               std::forward<Set>(set));
         return *this;
     }
-
+    
     template <typename E, typename T>
-    auto EnterSelection<E,T>::_add(group_type* update_selection_group, int index, const std::vector<T> &group_data) -> enter_selection_type& {
-        
-        if (mode != ONE_LIST_PER_GROUP)
-            throw std::runtime_error("incompatible add when adding without a list should be in ONE_LIST_PER_GROUP");
-        
-        entries.push_back({update_selection_group, index});
-        enter_data.push_back(group_data);
+    auto SelectionTransition<E,T>::delay(double delay) -> SelectionTransition& {
+        transition.delay = delay;
         return *this;
     }
-
-    template <typename E, typename T>
-    auto EnterSelection<E,T>::append(append_function_type append) -> selection_type {
-        selection_type result;
-        auto index = 0;
-        for (auto &e: entries) {
-            auto &new_group = result._group_add(e.group->parent);
-            
-            auto &data = (mode == SINGLE_SHARED_LIST) ? enter_data.at(0) : enter_data.at(index);
-            
-            for (auto it=data.begin() + e.index;it!=data.end();++it) {
-                auto new_element = append(e.group->parent.element, *it); // could use the data
-                new_group.add(new_element, *it);
-                e.group->add(new_element, *it);
-            }
-            ++index;
-        }
-        return result;
-    }
-
+    
     //------------------------------------------------------------------------------
-    // Document Impl.
+    // ChildrenJoin Impl.
     //------------------------------------------------------------------------------
     
-    template <typename E>
-    Document<E>::Document(E* root):
-    root(root)
+    template <typename E, typename T, typename P, typename D, typename A, typename X>
+    ChildrenJoin<E,T,P,D,A,X>::ChildrenJoin(selection_type &parents, P predicate, D data, A append, X exit, bool removing):
+    parents(parents),
+    predicate(std::move(predicate)),
+    data(std::move(data)),
+    append(std::move(append)),
+    exit_function(std::move(exit)),
+    removing(removing)
     {}
     
-    template <typename E>
-    template<typename I>
-    auto Document<E>::selectAll(predicate_type predicate, std::function<I(E*)> gen_iterator) -> selection_type {
+    template <typename E, typename T, typename P, typename D, typename A, typename X>
+    template <typename A2>
+    auto ChildrenJoin<E,T,P,D,A,X>::enter(A2&& append) -> ChildrenJoin<E,T,P,D,typename std::decay<A2>::type,X> {
+        return ChildrenJoin<E,T,P,D,typename std::decay<A2>::type,X>(parents, std::move(predicate), std::move(data),
+                                                                     std::forward<A2>(append), std::move(exit_function), removing);
+    }
+    
+    template <typename E, typename T, typename P, typename D, typename A, typename X>
+    template <typename X2>
+    auto ChildrenJoin<E,T,P,D,A,X>::exit(X2&& exit) -> ChildrenJoin<E,T,P,D,A,typename std::decay<X2>::type> {
+        return ChildrenJoin<E,T,P,D,A,typename std::decay<X2>::type>(parents, std::move(predicate), std::move(data),
+                                                                     std::move(append), std::forward<X2>(exit), removing);
+    }
+    
+    template <typename E, typename T, typename P, typename D, typename A, typename X>
+    auto ChildrenJoin<E,T,P,D,A,X>::remove() -> ChildrenJoin& {
+        removing = true;
+        return *this;
+    }
+    
+    template <typename E, typename T, typename P, typename D, typename A, typename X>
+    template <typename F>
+    ChildrenJoinCount ChildrenJoin<E,T,P,D,A,X>::call(F&& f) {
+        parents._check_data_guard();
         
-        if (!root)
-            throw std::runtime_error("oooops");
+        ChildrenJoinCount count;
+        auto document = parents.document;
+        bool observed = document && document->_observed();
         
-        selection_type result; // int is the default placeholder for data
-        auto &group = result._group_add(root);
+        detail::PhaseScope<E> scope(document, Stats::CALL, "ChildrenJoin::call");
+        std::size_t visited = 0;
         
-        auto it = gen_iterator(root);
-        while (auto e = it.next()) {
-            if (predicate(e)) {
-                group.add(e);
+        for (auto &ev: parents.elements) {
+            auto parent = ev.element;
+            auto &&data = this->data(ev);
+            auto n = data.size();
+            
+            std::size_t i = 0, surplus = 0;
+            TreeTraits<E>::for_each_child(parent, [&](E* child) {
+                ++visited;
+                if (!predicate(child))
+                    return;
+                if (i < n) {
+                    f(child, data[i++]);
+                    if (observed)
+                        document->_notify_update(child);
+                }
+                else {
+                    if (exiting)
+                        exit_function(child);
+                    ++surplus;
+                }
+            });
+            count.update += i;
+            count.exit   += surplus;
+            
+            if (surplus && removing) {
+                // the accepted children past the n-th: notified first,
+                // while their subtrees can still be walked
+                std::size_t accepted = 0;
+                if (document) {
+                    TreeTraits<E>::for_each_child(parent, [&](E* child) {
+                        if (predicate(child) && accepted++ >= n)
+                            document->_notify_remove(child);
+                    });
+                    accepted = 0;
+                }
+                TreeTraits<E>::erase_children(parent, [&](E* child) {
+                    return predicate(child) && accepted++ >= n;
+                });
+            }
+            
+            if (entering && i < n) {
+                TreeTraits<E>::reserve_children(parent, n - i);
+                count.enter += n - i;
+                for (;i<n;++i) {
+                    auto child = append(parent, data[i]);
+                    if (document)
+                        document->_notify_append(parent, child);
+                    f(child, data[i]);
+                }
             }
         }
-        return result;
+        scope.visited(visited, visited);
+        return count;
     }
     
 } // d3cpp
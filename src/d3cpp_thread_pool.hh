@@ -0,0 +1,233 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/*! \brief work stealing thread pool used by the parallel selection operations
+ *
+ * parallel_for splits [0,n) into chunks that are dealt to per worker
+ * queues. Workers pop their own queue from the back and steal from the
+ * front of the other queues. The calling thread also executes chunks,
+ * so nested parallel_for calls from inside a chunk cannot deadlock and
+ * a pool with zero workers degrades to a serial loop.
+ */
+
+namespace d3cpp {
+
+    //------------------------------------------------------------------------------
+    // ThreadPool
+    //------------------------------------------------------------------------------
+
+    class ThreadPool {
+    public:
+
+        // num_threads counts the calling thread: num_threads - 1 workers
+        explicit ThreadPool(std::size_t num_threads=std::thread::hardware_concurrency());
+        ~ThreadPool();
+
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool& operator=(const ThreadPool&) = delete;
+
+        // threads that execute chunks of a parallel_for (workers + caller)
+        std::size_t concurrency() const;
+
+        // calls f(begin, end) for disjoint chunks of at most grain
+        // indices covering [0,n) and returns when all of them are done.
+        // the first exception thrown by a chunk is rethrown here.
+        template <typename F>
+        void parallel_for(std::size_t n, std::size_t grain, F&& f);
+
+    private:
+
+        struct Job {
+            void (*run)(void *context, std::size_t begin, std::size_t end);
+            void                     *context;
+            std::atomic<std::size_t> remaining;
+            std::mutex               mutex;      // guards error and the last decrement
+            std::condition_variable  done;       // remaining reached 0
+            std::exception_ptr       error;
+        };
+
+        struct Task {
+            Job         *job;
+            std::size_t begin;
+            std::size_t end;
+        };
+
+        struct Queue {
+            std::mutex       mutex;
+            std::deque<Task> tasks;
+        };
+
+        void _worker(std::size_t index);
+        bool _pop(std::size_t index, Task &task);
+        bool _steal(std::size_t index, Task &task);
+        void _execute(const Task &task);
+
+        template <typename F>
+        static void _run(void *context, std::size_t begin, std::size_t end);
+
+    private:
+        std::vector<std::unique_ptr<Queue>> queues;   // one per worker
+        std::vector<std::thread>            workers;
+        std::mutex                          mutex;    // guards sleeping workers
+        std::condition_variable             wake;
+        std::atomic<std::size_t>            pending { 0 }; // queued tasks
+        bool                                stopping { false };
+    };
+
+    //------------------------------------------------------------------------------
+    // ThreadPool Impl.
+    //------------------------------------------------------------------------------
+
+    inline ThreadPool::ThreadPool(std::size_t num_threads) {
+        auto num_workers = num_threads > 1 ? num_threads - 1 : 0;
+        for (std::size_t i=0;i<num_workers;++i)
+            queues.push_back(std::unique_ptr<Queue>(new Queue()));
+        for (std::size_t i=0;i<num_workers;++i)
+            workers.push_back(std::thread(&ThreadPool::_worker, this, i));
+    }
+
+    inline ThreadPool::~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto &w: workers)
+            w.join();
+    }
+
+    inline std::size_t ThreadPool::concurrency() const {
+        return workers.size() + 1;
+    }
+
+    template <typename F>
+    void ThreadPool::_run(void *context, std::size_t begin, std::size_t end) {
+        (*static_cast<typename std::remove_reference<F>::type*>(context))(begin, end);
+    }
+
+    template <typename F>
+    void ThreadPool::parallel_for(std::size_t n, std::size_t grain, F&& f) {
+        if (n == 0)
+            return;
+        grain = std::max<std::size_t>(grain, 1);
+        auto num_chunks = (n + grain - 1) / grain;
+
+        if (workers.empty() || num_chunks == 1) {
+            for (std::size_t begin=0;begin<n;begin+=grain)
+                f(begin, std::min(n, begin + grain));
+            return;
+        }
+
+        Job job;
+        job.run       = &ThreadPool::_run<F>;
+        job.context   = static_cast<void*>(&f);
+        job.remaining = num_chunks;
+
+        // counted before they are queued: a worker taking one right away
+        // never drives pending below zero
+        pending.fetch_add(num_chunks);
+
+        // deal contiguous runs of chunks to the workers
+        auto num_queues = queues.size();
+        for (std::size_t q=0;q<num_queues;++q) {
+            auto first = num_chunks * q / num_queues;
+            auto last  = num_chunks * (q + 1) / num_queues;
+            if (first == last)
+                continue;
+            std::lock_guard<std::mutex> lock(queues[q]->mutex);
+            for (auto c=first;c<last;++c)
+                queues[q]->tasks.push_back({&job, c * grain, std::min(n, (c + 1) * grain)});
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+        }
+        wake.notify_all();
+
+        // the caller steals while there are chunks left in the queues,
+        // then sleeps until the workers are done with the others
+        Task task;
+        while (job.remaining.load() > 0 && _steal(num_queues, task))
+            _execute(task);
+        {
+            std::unique_lock<std::mutex> lock(job.mutex);
+            job.done.wait(lock, [&job]() { return job.remaining.load() == 0; });
+        }
+
+        if (job.error)
+            std::rethrow_exception(job.error);
+    }
+
+    inline bool ThreadPool::_pop(std::size_t index, Task &task) {
+        auto &queue = *queues[index];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty())
+            return false;
+        task = queue.tasks.back();
+        queue.tasks.pop_back();
+        pending.fetch_sub(1);
+        return true;
+    }
+
+    // steal from the front of any queue other than index
+    inline bool ThreadPool::_steal(std::size_t index, Task &task) {
+        auto num_queues = queues.size();
+        for (std::size_t k=1;k<=num_queues;++k) {
+            auto victim = (index + k) % num_queues;
+            if (victim == index)
+                continue;
+            auto &queue = *queues[victim];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.tasks.empty())
+                continue;
+            task = queue.tasks.front();
+            queue.tasks.pop_front();
+            pending.fetch_sub(1);
+            return true;
+        }
+        return false;
+    }
+
+    inline void ThreadPool::_execute(const Task &task) {
+        auto job = task.job;
+        try {
+            job->run(job->context, task.begin, task.end);
+        }
+        catch (...) {
+            std::lock_guard<std::mutex> lock(job->mutex);
+            if (!job->error)
+                job->error = std::current_exception();
+        }
+        // under the job's lock: its caller can't see 0, return and
+        // destroy the job before notify_one is done with it
+        std::lock_guard<std::mutex> lock(job->mutex);
+        if (job->remaining.fetch_sub(1) == 1)
+            job->done.notify_one();
+    }
+
+    inline void ThreadPool::_worker(std::size_t index) {
+        Task task;
+        while (true) {
+            if (_pop(index, task) || _steal(index, task)) {
+                _execute(task);
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [this]() { return stopping || pending.load() > 0; });
+            if (stopping)
+                return;
+        }
+    }
+
+} // d3cpp